@@ -0,0 +1,518 @@
+#pragma once
+
+// The harness of the benchmarks: runs a function with a warmup and
+// repetitions, summarizes the times and writes the results as a table and
+// as json (to track the regressions over time).
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+
+
+struct BenchOptions {
+  int warmup = 2;          // Repetitions run before the timed ones.
+  int reps = 15;           // Timed repetitions.
+  double min_time = .02;   // Seconds of a repetition, the iterations are calibrated to it.
+  std::string filter;      // Only the benchmarks with this in their name.
+  std::string json_path;   // Write the results here if not empty.
+  bool perf = false;       // Read the hardware counters of the timed repetitions.
+  uint64_t perf_raw = 0;   // A cpu specific event counted with them, 0 for none.
+  int threads = 0;         // Of the parallel kernels (set by the suite), 0 for the default.
+
+  // Parse --reps N, --warmup N, --min-time S, --filter NAME, --json PATH,
+  // --threads N, --perf and --perf-raw HEX (which implies --perf), returns
+  // false (after printing the usage) for anything else.
+  bool parse(int argc, char** argv, const char* usage);
+};
+
+
+// Hardware counters per call of a benchmark, a value is -1 if its event
+// isn't available (not on linux, no access to perf_event_open, or a virtual
+// machine without the pmu).
+struct PerfCounts {
+  bool valid = false; // Any of the events was counted.
+  double cycles = -1;
+  double instructions = -1;
+  double cache_misses = -1;  // Of the last level cache.
+  double branch_misses = -1;
+  double l1d_misses = -1;    // Of the reads.
+  double raw = -1;           // The event of --perf-raw, ex: the packed simd instructions.
+
+  double ipc() const { return (cycles > 0 && instructions >= 0) ? instructions / cycles : -1; }
+};
+
+
+// The events are counted with perf_event_open for the calling thread and
+// the threads it creates after open() (inherited), scaled if the kernel
+// multiplexed them. The threads which already exist aren't counted, so the
+// counters should be opened before the first parallel_for() starts the
+// workers of the pool.
+class PerfCounters {
+public:
+  enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, L1D_MISSES, RAW, EVENT_COUNT };
+
+  ~PerfCounters() { close(); }
+
+  // Returns false if none of the events can be opened.
+  bool open(uint64_t raw_config = 0);
+  void close();
+  bool is_open() const;
+
+  void start();
+
+  // The counts since start() divided by ops.
+  PerfCounts stop(double ops);
+
+private:
+  int _fds[EVENT_COUNT] = { -1, -1, -1, -1, -1, -1 };
+};
+
+
+// The counters of the benchmarks, opened at the first call with the options,
+// null if --perf isn't set or nothing can be counted. The first call should
+// be in main() before anything runs on the thread pool (see PerfCounters).
+PerfCounters* bench_perf_counters(const BenchOptions& options);
+
+
+// Times of the repetitions in nanoseconds per call.
+struct BenchStats {
+  double min = 0, median = 0, mean = 0, stddev = 0, max = 0;
+
+  static BenchStats of(std::vector<double> values);
+};
+
+
+struct BenchResult {
+  std::string name;
+  int64_t iterations = 0; // Per repetition.
+  int reps = 0;
+  BenchStats ns;          // Per call.
+  double flops = 0;       // Per call, 0 if not meaningful.
+  double bytes = 0;       // Moved per call.
+  PerfCounts perf;        // Per call, of all the timed repetitions.
+
+  // Of the median time.
+  double gflops() const { return (ns.median > 0) ? flops / ns.median : 0; }
+  double gbps() const { return (ns.median > 0) ? bytes / ns.median : 0; }
+};
+
+
+// A named row of values of the json results, for the benchmarks which
+// don't fit the ns/op of BenchResult.
+struct BenchRecord {
+  std::string name;
+  std::vector<std::pair<std::string, double>> values;
+};
+
+
+// A monotonic time in seconds.
+double bench_now();
+
+// The peak resident memory of the process in bytes, 0 if not available.
+int64_t bench_peak_rss();
+
+// Keep the compiler from removing the computation of the value.
+void bench_keep(double value);
+
+// Run fn() repeatedly with the options, fn should do a single call of the
+// measured operation.
+template <typename F>
+BenchResult bench_run(const BenchOptions& options, const std::string& name,
+                      double flops, double bytes, F fn);
+
+bool bench_selected(const BenchOptions& options, const std::string& name);
+
+void bench_print_header();
+void bench_print(const BenchResult& result);
+
+// {"suite": .., "context": {..}, "results": [..]}, the context values are
+// strings of the machine and the build (threads, blas...).
+bool bench_write_json(const char* path, const char* suite,
+                      const std::vector<std::pair<std::string, std::string>>& context,
+                      const std::vector<BenchResult>& results);
+bool bench_write_json(const char* path, const char* suite,
+                      const std::vector<std::pair<std::string, std::string>>& context,
+                      const std::vector<BenchRecord>& records);
+
+// Read the value of the key of each result of a json written by
+// bench_write_json() into values[name], returns false if the file can't be
+// read.
+bool bench_read_json(const char* path, const char* key, std::map<std::string, double>& values);
+
+
+template <typename F>
+BenchResult bench_run(const BenchOptions& options, const std::string& name,
+                      double flops, double bytes, F fn) {
+  BenchResult result;
+  result.name = name;
+  result.flops = flops;
+  result.bytes = bytes;
+
+  // Double the iterations until a repetition takes min_time.
+  int64_t iterations = 1;
+  for (;;) {
+    double start = bench_now();
+    for (int64_t i = 0; i < iterations; i++) fn();
+    double elapsed = bench_now() - start;
+    if (elapsed >= options.min_time || iterations >= ((int64_t)1 << 40)) break;
+    iterations *= (elapsed < options.min_time / 8) ? 8 : 2;
+  }
+
+  for (int rep = 0; rep < options.warmup; rep++) {
+    for (int64_t i = 0; i < iterations; i++) fn();
+  }
+
+  PerfCounters* counters = bench_perf_counters(options);
+  if (counters != nullptr) counters->start();
+
+  std::vector<double> times;
+  for (int rep = 0; rep < options.reps; rep++) {
+    double start = bench_now();
+    for (int64_t i = 0; i < iterations; i++) fn();
+    times.push_back((bench_now() - start) * 1e9 / iterations);
+  }
+
+  if (counters != nullptr) result.perf = counters->stop((double) iterations * options.reps);
+
+  result.iterations = iterations;
+  result.reps = options.reps;
+  result.ns = BenchStats::of(times);
+  return result;
+}
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #define NOMINMAX
+  #include <windows.h>
+  #include <psapi.h>
+#else
+  #include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+
+bool BenchOptions::parse(int argc, char** argv, const char* usage) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if (value && strcmp(arg, "--reps") == 0) reps = atoi(value);
+    else if (value && strcmp(arg, "--warmup") == 0) warmup = atoi(value);
+    else if (value && strcmp(arg, "--min-time") == 0) min_time = atof(value);
+    else if (value && strcmp(arg, "--filter") == 0) filter = value;
+    else if (value && strcmp(arg, "--json") == 0) json_path = value;
+    else if (value && strcmp(arg, "--threads") == 0) threads = atoi(value);
+    else if (value && strcmp(arg, "--perf-raw") == 0) perf_raw = strtoull(value, nullptr, 16);
+    else if (strcmp(arg, "--perf") == 0) {
+      perf = true;
+      continue; // No value.
+    } else {
+      fprintf(stderr, "usage: %s %s\n", argv[0], usage);
+      return false;
+    }
+    i++;
+  }
+  if (perf_raw != 0) perf = true;
+  if (reps < 1) reps = 1;
+  if (warmup < 0) warmup = 0;
+  return true;
+}
+
+
+BenchStats BenchStats::of(std::vector<double> values) {
+  BenchStats stats;
+  if (values.empty()) return stats;
+
+  std::sort(values.begin(), values.end());
+  const size_t n = values.size();
+  stats.min = values.front();
+  stats.max = values.back();
+  stats.median = (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+
+  double sum = 0;
+  for (double v : values) sum += v;
+  stats.mean = sum / n;
+
+  double var = 0;
+  for (double v : values) var += (v - stats.mean) * (v - stats.mean);
+  stats.stddev = (n > 1) ? sqrt(var / (n - 1)) : 0;
+  return stats;
+}
+
+
+double bench_now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+int64_t bench_peak_rss() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+  return (int64_t) counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  #ifdef __APPLE__
+    return (int64_t) usage.ru_maxrss; // Bytes on macos, kilobytes on linux.
+  #else
+    return (int64_t) usage.ru_maxrss * 1024;
+  #endif
+#endif
+}
+
+
+#ifdef __linux__
+
+static int _perf_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+bool PerfCounters::open(uint64_t raw_config) {
+  close();
+  const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  _fds[CYCLES] = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  _fds[INSTRUCTIONS] = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  _fds[CACHE_MISSES] = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  _fds[BRANCH_MISSES] = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  _fds[L1D_MISSES] = _perf_open(PERF_TYPE_HW_CACHE, l1d_read_miss);
+  if (raw_config != 0) _fds[RAW] = _perf_open(PERF_TYPE_RAW, raw_config);
+  return is_open();
+}
+
+
+void PerfCounters::close() {
+  for (int& fd : _fds) {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+  }
+}
+
+
+void PerfCounters::start() {
+  for (int fd : _fds) {
+    if (fd < 0) continue;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+
+PerfCounts PerfCounters::stop(double ops) {
+  double values[EVENT_COUNT];
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    values[i] = -1;
+    if (_fds[i] < 0) continue;
+    ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    // The value, the time enabled and the time running (less if multiplexed).
+    uint64_t data[3];
+    if (read(_fds[i], data, sizeof(data)) != (ssize_t) sizeof(data) || data[2] == 0) continue;
+    values[i] = (double) data[0] * ((double) data[1] / data[2]) / ops;
+  }
+
+  PerfCounts counts;
+  counts.cycles = values[CYCLES];
+  counts.instructions = values[INSTRUCTIONS];
+  counts.cache_misses = values[CACHE_MISSES];
+  counts.branch_misses = values[BRANCH_MISSES];
+  counts.l1d_misses = values[L1D_MISSES];
+  counts.raw = values[RAW];
+  for (double value : values) counts.valid |= value >= 0;
+  return counts;
+}
+
+#else
+
+bool PerfCounters::open(uint64_t) { return false; }
+void PerfCounters::close() {}
+void PerfCounters::start() {}
+PerfCounts PerfCounters::stop(double) { return PerfCounts(); }
+
+#endif // __linux__
+
+
+bool PerfCounters::is_open() const {
+  for (int fd : _fds) {
+    if (fd >= 0) return true;
+  }
+  return false;
+}
+
+
+PerfCounters* bench_perf_counters(const BenchOptions& options) {
+  static PerfCounters counters;
+  static bool opened = false;
+  if (!options.perf) return nullptr;
+
+  if (!opened) {
+    opened = true;
+    if (!counters.open(options.perf_raw)) {
+      fprintf(stderr, "perf: no hardware counter can be opened (perf_event_paranoid, or no pmu)\n");
+    }
+  }
+  return (counters.is_open()) ? &counters : nullptr;
+}
+
+
+static volatile double _bench_sink;
+
+
+void bench_keep(double value) {
+  _bench_sink = value;
+}
+
+
+bool bench_selected(const BenchOptions& options, const std::string& name) {
+  return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+
+void bench_print_header() {
+  printf("%-36s %12s %10s %10s %9s %9s\n", "benchmark", "ns/op", "min", "stddev", "GFLOP/s", "GB/s");
+}
+
+
+void bench_print(const BenchResult& r) {
+  printf("%-36s %12.1f %10.1f %9.1f%% %9.2f %9.2f\n", r.name.c_str(), r.ns.median, r.ns.min,
+         (r.ns.mean > 0) ? r.ns.stddev / r.ns.mean * 100 : 0, r.gflops(), r.gbps());
+
+  // The counters per call on their own line, n/a if not available.
+  if (r.perf.valid) {
+    auto field = [](const char* name, double value) {
+      if (value >= 0) printf("  %s %.4g", name, value);
+      else printf("  %s n/a", name);
+    };
+    printf("%-4s", "");
+    field("ipc", r.perf.ipc());
+    field("cycles", r.perf.cycles);
+    field("llc-miss", r.perf.cache_misses);
+    field("l1d-miss", r.perf.l1d_misses);
+    field("branch-miss", r.perf.branch_misses);
+    if (r.perf.raw >= 0) field("raw", r.perf.raw);
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+
+// The names and values here are plain identifiers and numbers, only the
+// quotes and backslashes are escaped.
+static std::string _bench_json_string(const std::string& s) {
+  std::string escaped = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') escaped += '\\';
+    escaped += c;
+  }
+  return escaped + "\"";
+}
+
+
+bool bench_write_json(const char* path, const char* suite,
+                      const std::vector<std::pair<std::string, std::string>>& context,
+                      const std::vector<BenchRecord>& records) {
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) return false;
+
+  fprintf(file, "{\n  \"suite\": %s,\n  \"context\": {", _bench_json_string(suite).c_str());
+  for (size_t i = 0; i < context.size(); i++) {
+    fprintf(file, "%s\n    %s: %s", (i > 0) ? "," : "",
+            _bench_json_string(context[i].first).c_str(), _bench_json_string(context[i].second).c_str());
+  }
+  fprintf(file, "\n  },\n  \"results\": [");
+
+  // A result per line, bench_read_json() depends on it.
+  for (size_t i = 0; i < records.size(); i++) {
+    const BenchRecord& r = records[i];
+    fprintf(file, "%s\n    {\"name\": %s", (i > 0) ? "," : "", _bench_json_string(r.name).c_str());
+    for (const auto& value : r.values) {
+      fprintf(file, ", %s: %.10g", _bench_json_string(value.first).c_str(), value.second);
+    }
+    fprintf(file, "}");
+  }
+  fprintf(file, "\n  ]\n}\n");
+  fclose(file);
+  return true;
+}
+
+
+bool bench_write_json(const char* path, const char* suite,
+                      const std::vector<std::pair<std::string, std::string>>& context,
+                      const std::vector<BenchResult>& results) {
+  std::vector<BenchRecord> records;
+  for (const BenchResult& r : results) {
+    records.push_back({ r.name, {
+      { "iterations", (double) r.iterations }, { "reps", (double) r.reps },
+      { "ns_per_op", r.ns.median }, { "ns_min", r.ns.min }, { "ns_mean", r.ns.mean },
+      { "ns_stddev", r.ns.stddev }, { "ns_max", r.ns.max },
+      { "gflops", r.gflops() }, { "gbps", r.gbps() },
+    }});
+
+    // Per call, -1 for the events which weren't counted.
+    if (r.perf.valid) {
+      std::vector<std::pair<std::string, double>>& values = records.back().values;
+      values.push_back({ "ipc", r.perf.ipc() });
+      values.push_back({ "cycles", r.perf.cycles });
+      values.push_back({ "instructions", r.perf.instructions });
+      values.push_back({ "llc_misses", r.perf.cache_misses });
+      values.push_back({ "l1d_misses", r.perf.l1d_misses });
+      values.push_back({ "branch_misses", r.perf.branch_misses });
+      values.push_back({ "raw_events", r.perf.raw });
+    }
+  }
+  return bench_write_json(path, suite, context, records);
+}
+
+
+bool bench_read_json(const char* path, const char* key, std::map<std::string, double>& values) {
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) return false;
+
+  const std::string name_key = "\"name\": \"";
+  const std::string value_key = std::string("\"") + key + "\": ";
+
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), file) != nullptr) {
+    std::string line = buffer;
+    size_t name = line.find(name_key);
+    size_t value = line.find(value_key);
+    if (name == std::string::npos || value == std::string::npos) continue;
+
+    name += name_key.size();
+    size_t end = line.find('"', name);
+    if (end == std::string::npos) continue;
+    values[line.substr(name, end - name)] = atof(line.c_str() + value + value_key.size());
+  }
+  fclose(file);
+  return true;
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,111 @@
+// Trains the dense model of the app and a small conv net on mnist and
+// compares the cost of their forward pass, the training time, the test
+// accuracy and the memory of the layer outputs per sample (the planned
+// inference workspace and what the training keeps).
+//
+//   conv-bench [epochs] [train_count] [dataset_dir]
+//
+// By default one epoch over the whole training set, and the dataset is read
+// from ../dataset (run it from the build directory like the app).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#define Matrix RaylibMatrix
+  #include <raylib.h>
+#undef Matrix
+
+
+#define assert(cond)                                                         \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "Assertion failed: %s (%s:%i)\n", #cond, __FILE__, __LINE__); \
+      abort();                                                               \
+    }                                                                        \
+  } while (false)
+
+#define SINGLE_SOURCE_IMPL
+  #include "numa.hpp"
+  #include "trace.hpp"
+  #include "parallel.hpp"
+  #include "memory.hpp"
+  #include "random.hpp"
+  #include "blas.hpp"
+  #include "half.hpp"
+  #include "matrix.hpp"
+  #include "activation.hpp"
+  #include "conv.hpp"
+  #include "profile.hpp"
+  #include "graph.hpp"
+  #include "nodes.hpp"
+  #include "optimizer.hpp"
+  #include "snapshot.hpp"
+  #include "nn.hpp"
+  #include "metrics.hpp"
+  #include "utils.hpp"
+#undef SINGLE_SOURCE_IMPL
+
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+static void run(const char* name, NN& nn, const DsMinist& train, const DsMinist& test,
+                int epochs, int train_count) {
+
+  auto start = std::chrono::steady_clock::now();
+  for (int epoch = 0; epoch < epochs; epoch++) {
+    for (int index = 0; index < train_count; index++) {
+      nn.forward(train.input_view(index));
+      nn.backprop(train.get_output(index));
+    }
+  }
+  double train_seconds = seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  float test_accuracy = evaluate_classification(nn, test, 0, test.count()).accuracy();
+  double test_seconds = seconds_since(start);
+
+  printf("%-6s %10lld %14lld %12.2f %12.1f %9.2f%% %7zu/%zu\n", name,
+         (long long) nn.parameter_count(), (long long) nn.forward_flops(),
+         train_seconds, test_seconds * 1000, test_accuracy * 100,
+         nn.graph.inference_bytes(1), nn.graph.training_bytes(1));
+}
+
+
+int main(int argc, char** argv) {
+  int epochs = (argc > 1) ? atoi(argv[1]) : 1;
+  int train_count = (argc > 2) ? atoi(argv[2]) : 0;
+  std::string dir = (argc > 3) ? argv[3] : "../dataset";
+
+  DsMinist train((dir + "/train-labels.idx1-ubyte").c_str(), (dir + "/train-images.idx3-ubyte").c_str());
+  DsMinist test((dir + "/t10k-labels.idx1-ubyte").c_str(), (dir + "/t10k-images.idx3-ubyte").c_str());
+  if (train_count <= 0 || train_count > train.count()) train_count = train.count();
+
+  const std::vector<std::string> labels = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" };
+
+  // The model of the app.
+  NN dense({ 784, 20, 10, 10 }, labels,
+           { Activation::RELU, Activation::RELU, Activation::SOFTMAX }, WeightInit::HE);
+
+  // 8 5x5 filters with stride 2 (8x12x12), 2x2 max pool (8x6x6), softmax.
+  NN conv({
+      LayerConfig::input(1, 28, 28),
+      LayerConfig::conv2d(8, 5, Activation::RELU, 2),
+      LayerConfig::max_pool(2),
+      LayerConfig::dense(10, Activation::SOFTMAX),
+    }, labels, WeightInit::HE);
+
+  printf("%d epoch(s) over %d samples, %d test samples, blas: %s\n\n",
+         epochs, train_count, test.count(), blas_backend_name());
+  printf("%-6s %10s %14s %12s %12s %10s %s\n", "model", "params", "flops/sample",
+         "train (s)", "test (ms)", "accuracy", "bytes/sample (infer/train)");
+  run("dense", dense, train, test, epochs, train_count);
+  run("conv", conv, train, test, epochs, train_count);
+
+  return 0;
+}
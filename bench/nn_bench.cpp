@@ -0,0 +1,294 @@
+// Micro benchmarks of the matrix operations and the kernels of the model,
+// each reports the time of a call (median of the repetitions), GFLOP/s and
+// GB/s. With --json the results are written for tracking the regressions.
+//
+//   nn-bench [--filter NAME] [--reps N] [--warmup N] [--min-time S] [--json PATH]
+//            [--threads N] [--perf] [--perf-raw HEX]
+//
+// --perf reads the hardware counters of each benchmark (linux, see
+// PerfCounters): ipc, last level cache and l1d misses, branch misses per
+// call. --perf-raw adds a cpu specific event, ex: 0x20c7 for the packed
+// 256 bit single precision instructions of intel (FP_ARITH_INST_RETIRED).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+
+#define assert(cond)                                                         \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "Assertion failed: %s (%s:%i)\n", #cond, __FILE__, __LINE__); \
+      abort();                                                               \
+    }                                                                        \
+  } while (false)
+
+#define SINGLE_SOURCE_IMPL
+  #include "numa.hpp"
+  #include "trace.hpp"
+  #include "parallel.hpp"
+  #include "memory.hpp"
+  #include "random.hpp"
+  #include "blas.hpp"
+  #include "half.hpp"
+  #include "matrix.hpp"
+  #include "activation.hpp"
+  #include "conv.hpp"
+  #include "profile.hpp"
+  #include "graph.hpp"
+  #include "nodes.hpp"
+  #include "optimizer.hpp"
+  #include "snapshot.hpp"
+  #include "nn.hpp"
+  #include "bench.hpp"
+#undef SINGLE_SOURCE_IMPL
+
+
+// Runs the selected benchmarks and collects the results.
+struct Suite {
+  BenchOptions options;
+  std::vector<BenchResult> results;
+
+  template <typename F>
+  void run(const std::string& name, double flops, double bytes, F fn) {
+    if (!bench_selected(options, name)) return;
+    results.push_back(bench_run(options, name, flops, bytes, fn));
+    bench_print(results.back());
+  }
+};
+
+
+static Matrix random_matrix(int rows, int cols, uint64_t stream) {
+  Matrix m(rows, cols);
+  m.randomize(Rng(RANDOM_DEFAULT_SEED, stream), -1, 1);
+  return m;
+}
+
+
+static std::string shape_name(int rows, int cols) {
+  return std::to_string(rows) + "x" + std::to_string(cols);
+}
+
+
+// (m x k) * (k x n), both the allocating operator and gemm into an existing
+// output.
+static void bench_matmul(Suite& suite, int m, int k, int n) {
+  Matrix a = random_matrix(m, k, 1), b = random_matrix(k, n, 2);
+  Matrix c(m, n);
+  const double flops = 2.0 * m * k * n;
+  const double bytes = sizeof(matrix_t) * ((double) m * k + (double) k * n + (double) m * n);
+  const std::string shape = shape_name(m, k) + "*" + shape_name(k, n);
+
+  suite.run("mul/" + shape, flops, bytes, [&]() {
+    Matrix r = a * b;
+    bench_keep(r.data()[0]);
+  });
+
+  suite.run("gemm/" + shape, flops, bytes, [&]() {
+    gemm<matrix_t>(a, b, c, 1, 0);
+    bench_keep(c.data()[0]);
+  });
+}
+
+
+static void bench_transpose(Suite& suite, int rows, int cols) {
+  Matrix a = random_matrix(rows, cols, 3);
+  suite.run("transpose/" + shape_name(rows, cols), 0, 2.0 * sizeof(matrix_t) * rows * cols, [&]() {
+    Matrix t = a.transpose();
+    bench_keep(t.data()[0]);
+  });
+}
+
+
+// The element wise operations and the reductions over n values.
+static void bench_elementwise(Suite& suite, int rows, int cols) {
+  Matrix a = random_matrix(rows, cols, 4), b = random_matrix(rows, cols, 5);
+  Matrix c(rows, cols);
+  const double n = (double) rows * cols;
+  const double size = sizeof(matrix_t);
+  const std::string shape = shape_name(rows, cols);
+
+  suite.run("add/" + shape, n, 3 * size * n, [&]() {
+    c = a + b;
+    bench_keep(c.data()[0]);
+  });
+
+  suite.run("sub/" + shape, n, 3 * size * n, [&]() {
+    c = a - b;
+    bench_keep(c.data()[0]);
+  });
+
+  suite.run("multiply/" + shape, n, 3 * size * n, [&]() {
+    c = a.multiply(b);
+    bench_keep(c.data()[0]);
+  });
+
+  suite.run("scale/" + shape, n, 2 * size * n, [&]() {
+    c = a * (matrix_t) .5;
+    bench_keep(c.data()[0]);
+  });
+
+  suite.run("axpy/" + shape, 2 * n, 3 * size * n, [&]() {
+    axpy<matrix_t>((matrix_t) 1e-3, a, c);
+    bench_keep(c.data()[0]);
+  });
+
+  // In place, the values converge but the work doesn't change.
+  suite.run("sigmoid/" + shape, n, 2 * size * n, [&]() {
+    c.sigmoid();
+    bench_keep(c.data()[0]);
+  });
+
+  suite.run("sum/" + shape, n, size * n, [&]() {
+    bench_keep(a.sum());
+  });
+
+  suite.run("sum_compensated/" + shape, 4 * n, size * n, [&]() {
+    bench_keep(a.sum_compensated());
+  });
+
+  // The flops are the values generated.
+  suite.run("randomize/" + shape, n, size * n, [&]() {
+    c.randomize(Rng(1, 0), -1, 1);
+    bench_keep(c.data()[0]);
+  });
+
+  suite.run("randomize_normal/" + shape, n, size * n, [&]() {
+    c.randomize_normal(Rng(1, 0), 0, 1);
+    bench_keep(c.data()[0]);
+  });
+}
+
+
+static void bench_activations(Suite& suite, int rows, int cols) {
+  const Activation activations[] = {
+    Activation::SIGMOID, Activation::RELU, Activation::LEAKY_RELU, Activation::TANH, Activation::SOFTMAX,
+  };
+  Matrix a = random_matrix(rows, cols, 6);
+  const double n = (double) rows * cols;
+
+  for (Activation activation : activations) {
+    std::string name = std::string("activation/") + activation_name(activation) + "/" + shape_name(rows, cols);
+    suite.run(name, n, 2 * sizeof(matrix_t) * n, [&]() {
+      activation_forward(activation, a);
+      bench_keep(a.data()[0]);
+    });
+  }
+}
+
+
+static void bench_packed(Suite& suite, int m, int k, int n) {
+  Matrix a = random_matrix(m, k, 7), b = random_matrix(k, n, 8);
+  Matrix c(m, n);
+  const Precision precisions[] = { Precision::FP16, Precision::BF16 };
+  const char* names[] = { "fp16", "bf16" };
+
+  for (int i = 0; i < 2; i++) {
+    PackedMatrix packed;
+    packed.pack(b, precisions[i]);
+    const double bytes = sizeof(matrix_t) * ((double) m * k + (double) m * n) + 2.0 * k * n;
+    suite.run(std::string("gemm_packed_") + names[i] + "/" + shape_name(m, k) + "*" + shape_name(k, n),
+              2.0 * m * k * n, bytes, [&]() {
+      gemm_packed(a, packed, c);
+      bench_keep(c.data()[0]);
+    });
+  }
+}
+
+
+// A batch of mnist sized images through 8 5x5 filters with stride 2.
+static void bench_conv(Suite& suite, int batch) {
+  ConvWindow window;
+  window.input = { 1, 28, 28 };
+  window.kernel = 5;
+  window.stride = 2;
+  const int filters = 8;
+
+  Matrix input = random_matrix(batch, window.input.size(), 9);
+  Matrix weights = random_matrix(window.patch_size(), filters, 10);
+  Matrix bias = random_matrix(1, filters, 11);
+  Matrix output(batch, filters * window.positions());
+  Matrix cols(window.patch_size(), window.positions());
+  const double flops = 2.0 * batch * window.patch_size() * filters * window.positions();
+  const double bytes = sizeof(matrix_t) * ((double) input.data().size() + output.data().size() + weights.data().size());
+
+  suite.run("conv2d/1x28x28-8f5s2/b" + std::to_string(batch), flops, bytes, [&]() {
+    conv2d_forward(window, input, weights, bias, output, cols);
+    bench_keep(output.data()[0]);
+  });
+}
+
+
+// The model of the app.
+static void bench_predict(Suite& suite, int batch) {
+  NN nn({ 784, 20, 10, 10 }, { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" },
+        { Activation::RELU, Activation::RELU, Activation::SOFTMAX }, WeightInit::HE);
+  Matrix input = random_matrix(batch, 784, 12);
+  Matrix output(batch, 10);
+  InferenceWorkspace workspace;
+  const double flops = (double) batch * nn.forward_flops();
+  const double bytes = sizeof(matrix_t) * ((double) nn.parameter_count() + input.data().size());
+
+  suite.run("predict/784-20-10-10/b" + std::to_string(batch), flops, bytes, [&]() {
+    nn.predict(input, output, workspace);
+    bench_keep(output.data()[0]);
+  });
+}
+
+
+int main(int argc, char** argv) {
+  Suite suite;
+  if (!suite.options.parse(argc, argv, "[--filter NAME] [--reps N] [--warmup N] [--min-time S] [--json PATH] "
+                                          "[--threads N] [--perf] [--perf-raw HEX]")) {
+    return 1;
+  }
+  if (suite.options.threads > 0) set_parallel_threads(suite.options.threads);
+
+  // Before the pool starts, so its workers inherit the counters.
+  bench_perf_counters(suite.options);
+
+  printf("blas: %s, threads: %d, matrix_t: %zu bytes\n\n", blas_backend_name(), parallel_threads(), sizeof(matrix_t));
+  bench_print_header();
+
+  bench_matmul(suite, 1, 784, 20);
+  bench_matmul(suite, 32, 784, 20);
+  bench_matmul(suite, 1, 20, 10);
+  bench_matmul(suite, 128, 128, 128);
+  bench_matmul(suite, 256, 256, 256);
+  bench_matmul(suite, 512, 512, 512);
+
+  bench_transpose(suite, 784, 20);
+  bench_transpose(suite, 512, 512);
+
+  bench_elementwise(suite, 1, 1024);
+  bench_elementwise(suite, 1024, 1024);
+
+  bench_activations(suite, 32, 1024);
+
+  bench_packed(suite, 1, 784, 20);
+  bench_packed(suite, 32, 784, 20);
+
+  bench_conv(suite, 1);
+  bench_conv(suite, 32);
+
+  bench_predict(suite, 1);
+  bench_predict(suite, 32);
+
+  if (!suite.options.json_path.empty()) {
+    std::vector<std::pair<std::string, std::string>> context = {
+      { "blas", blas_backend_name() },
+      { "threads", std::to_string(parallel_threads()) },
+      { "matrix_t_bytes", std::to_string(sizeof(matrix_t)) },
+      { "reps", std::to_string(suite.options.reps) },
+      { "perf", (bench_perf_counters(suite.options) != nullptr) ? "on" : "off" },
+    };
+    if (!bench_write_json(suite.options.json_path.c_str(), "nn-bench", context, suite.results)) {
+      fprintf(stderr, "Cannot write %s\n", suite.options.json_path.c_str());
+      return 1;
+    }
+    printf("\nResults written to %s\n", suite.options.json_path.c_str());
+  }
+
+  return 0;
+}
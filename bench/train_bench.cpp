@@ -0,0 +1,360 @@
+// Trains the model of the app and larger ones for a fixed number of samples
+// and reports the training throughput (samples/s), the time to reach the
+// target test accuracy and the peak memory of the process. The data is
+// synthetic with the shape of mnist, generated from a fixed seed, so the runs
+// are reproducible without the dataset.
+//
+// With --baseline the throughput is compared to a json written by --json of
+// an earlier run and the exit code is 1 if a model regressed more than the
+// tolerance.
+//
+//   train-bench [--filter NAME] [--samples N] [--batch N] [--rate R]
+//               [--target ACC] [--eval-every N] [--train N] [--test N]
+//               [--threads N] [--json PATH] [--baseline PATH] [--tolerance F]
+//               [--trace PATH] [--numa]
+//
+// --trace writes the timeline of the run (chrome trace format, see trace.hpp).
+// --numa interleaves the datasets and the parameters over the numa nodes and
+// pins the threads of the pool (see numa.hpp).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+
+
+#define assert(cond)                                                         \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "Assertion failed: %s (%s:%i)\n", #cond, __FILE__, __LINE__); \
+      abort();                                                               \
+    }                                                                        \
+  } while (false)
+
+#define SINGLE_SOURCE_IMPL
+  #include "numa.hpp"
+  #include "trace.hpp"
+  #include "parallel.hpp"
+  #include "memory.hpp"
+  #include "random.hpp"
+  #include "blas.hpp"
+  #include "half.hpp"
+  #include "matrix.hpp"
+  #include "activation.hpp"
+  #include "conv.hpp"
+  #include "profile.hpp"
+  #include "graph.hpp"
+  #include "nodes.hpp"
+  #include "optimizer.hpp"
+  #include "snapshot.hpp"
+  #include "nn.hpp"
+  #include "metrics.hpp"
+  #include "bench.hpp"
+#undef SINGLE_SOURCE_IMPL
+
+
+#define SYNTHETIC_CLASSES 10
+#define SYNTHETIC_SIZE    784
+
+
+// Images of 10 classes, each class is a random prototype and a sample is its
+// prototype blended with the prototype of another class and noise. The
+// prototypes are of the seed alone, the samples of the seed and the stream
+// (use different streams for the train and test sets).
+class DsSynthetic : public Dataset {
+public:
+  DsSynthetic(int count, uint64_t stream, uint64_t seed = RANDOM_DEFAULT_SEED);
+
+  int count() const override { return (int) labels.size(); }
+  Matrix get_input(int index) const override;
+  Matrix get_output(int index) const override;
+  ConstMatrixView input_view(int index) const override { return ConstMatrixView(inputs).row(index); }
+  ConstMatrixView input_batch(int index, int count) const override { return ConstMatrixView(inputs).rows(index, count); }
+  int get_label(int index) const override { return labels[index]; }
+
+  Matrix inputs;  // A sample per row.
+  Matrix outputs; // One hot of the labels.
+  std::vector<int> labels;
+};
+
+
+DsSynthetic::DsSynthetic(int count, uint64_t stream, uint64_t seed) {
+  Matrix prototypes(SYNTHETIC_CLASSES, SYNTHETIC_SIZE);
+  prototypes.randomize(Rng(seed, 0), 0, 1);
+
+  inputs.init(count, SYNTHETIC_SIZE);
+  outputs.init(count, SYNTHETIC_CLASSES);
+  outputs.fill(0);
+  labels.resize(count);
+
+  Matrix noise(count, SYNTHETIC_SIZE);
+  noise.randomize_normal(Rng(seed, 2 * stream + 1), 0, .4f);
+
+  Rng rng(seed, 2 * stream + 2);
+  for (int i = 0; i < count; i++) {
+    int label = (int) (rng.at(2 * i) % SYNTHETIC_CLASSES);
+    int other = (label + 1 + (int) (rng.at(2 * i + 1) % (SYNTHETIC_CLASSES - 1))) % SYNTHETIC_CLASSES;
+    labels[i] = label;
+    MatrixView(outputs).row_data(i)[label] = 1;
+
+    const matrix_t* a = ConstMatrixView(prototypes).row_data(label);
+    const matrix_t* b = ConstMatrixView(prototypes).row_data(other);
+    const matrix_t* n = ConstMatrixView(noise).row_data(i);
+    matrix_t* x = MatrixView(inputs).row_data(i);
+    for (int p = 0; p < SYNTHETIC_SIZE; p++) {
+      x[p] = (matrix_t) (.6f * a[p] + .4f * b[p] + n[p]);
+    }
+  }
+  numa_interleave(inputs.data().data(), inputs.data().size() * sizeof(matrix_t));
+}
+
+
+Matrix DsSynthetic::get_input(int index) const {
+  Matrix input(1, SYNTHETIC_SIZE);
+  MatrixView(input).assign(input_view(index));
+  return input;
+}
+
+
+Matrix DsSynthetic::get_output(int index) const {
+  Matrix output(1, SYNTHETIC_CLASSES);
+  MatrixView(output).assign(ConstMatrixView(outputs).row(index));
+  return output;
+}
+
+
+struct Options {
+  std::string filter;
+  int samples = 20000;    // Trained per model.
+  int batch = 1;           // Samples of a backprop, the app trains one at a time.
+  float rate = .01f;       // Of a sample, the rate of a batch is rate / batch.
+  float target = .9f;      // Test accuracy of the time to target.
+  int eval_every = 1000;   // Samples between the evaluations (not timed).
+  int train_count = 10000;
+  int test_count = 2000;
+  int threads = 0;         // 0 for the default.
+  bool numa = false;       // Interleave the shared buffers and pin the threads (numa.hpp).
+  std::string json_path;
+  std::string baseline_path;
+  float tolerance = .1f;   // Allowed throughput loss relative to the baseline.
+  std::string trace_path;
+
+  bool parse(int argc, char** argv);
+};
+
+
+bool Options::parse(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if (value && strcmp(arg, "--filter") == 0) filter = value;
+    else if (value && strcmp(arg, "--samples") == 0) samples = atoi(value);
+    else if (value && strcmp(arg, "--batch") == 0) batch = atoi(value);
+    else if (value && strcmp(arg, "--rate") == 0) rate = (float) atof(value);
+    else if (value && strcmp(arg, "--target") == 0) target = (float) atof(value);
+    else if (value && strcmp(arg, "--eval-every") == 0) eval_every = atoi(value);
+    else if (value && strcmp(arg, "--train") == 0) train_count = atoi(value);
+    else if (value && strcmp(arg, "--test") == 0) test_count = atoi(value);
+    else if (value && strcmp(arg, "--threads") == 0) threads = atoi(value);
+    else if (value && strcmp(arg, "--json") == 0) json_path = value;
+    else if (value && strcmp(arg, "--baseline") == 0) baseline_path = value;
+    else if (value && strcmp(arg, "--tolerance") == 0) tolerance = (float) atof(value);
+    else if (value && strcmp(arg, "--trace") == 0) trace_path = value;
+    else if (strcmp(arg, "--numa") == 0) {
+      numa = true;
+      continue; // No value.
+    } else {
+      fprintf(stderr, "usage: %s [--filter NAME] [--samples N] [--batch N] [--rate R] [--target ACC]\n"
+                      "       [--eval-every N] [--train N] [--test N] [--threads N] [--numa]\n"
+                      "       [--json PATH] [--baseline PATH] [--tolerance F] [--trace PATH]\n", argv[0]);
+      return false;
+    }
+    i++;
+  }
+  if (batch < 1) batch = 1;
+  if (eval_every < batch) eval_every = batch;
+  return samples > 0 && train_count >= batch && test_count > 0;
+}
+
+
+struct TrainResult {
+  double samples_per_sec = 0;
+  double seconds = 0;          // Of the training alone.
+  double target_seconds = -1;  // Training time to the target accuracy, -1 if not reached.
+  int target_samples = -1;
+  float accuracy = 0;          // At the end.
+  int64_t peak_rss = 0;        // Of the process after the training.
+  double step_allocations = 0; // Matrix allocations of a training step (forward + backprop).
+  int64_t peak_matrix_bytes = 0;
+};
+
+
+// Train on the samples in order (wrapping around the train set), the
+// evaluations of the test set every eval_every samples aren't part of the
+// training time.
+static TrainResult train(NN& nn, const DsSynthetic& train_set, const DsSynthetic& test_set,
+                         const Options& options) {
+  TrainResult result;
+  nn.learn_rate = options.rate / options.batch;
+  Matrix expected(options.batch, SYNTHETIC_CLASSES);
+
+  // Without the blocks cached for the previous model.
+  MemoryPool::trim_all();
+  memory_reset_stats();
+  int64_t allocations = 0, steps = 0;
+
+  int trained = 0, index = 0;
+  while (trained < options.samples) {
+    const int rows = std::min(options.batch, options.samples - trained);
+    if (index + rows > train_set.count()) index = 0;
+
+    double start = bench_now();
+    int64_t allocations_before = memory_stats().allocations;
+    {
+      TRACE_SCOPE("load", "data");
+      if (rows != expected.rows()) expected.init(rows, SYNTHETIC_CLASSES);
+      MatrixView(expected).assign(ConstMatrixView(train_set.outputs).rows(index, rows));
+    }
+    nn.forward(train_set.input_batch(index, rows));
+    nn.backprop(expected);
+    allocations += memory_stats().allocations - allocations_before;
+    steps++;
+    result.seconds += bench_now() - start;
+
+    // Evaluate when a multiple of eval_every is crossed and at the end.
+    int before = trained;
+    trained += rows;
+    index += rows;
+    if (trained / options.eval_every != before / options.eval_every || trained == options.samples) {
+      result.accuracy = evaluate_classification(nn, test_set, 0, test_set.count()).accuracy();
+      if (result.target_seconds < 0 && result.accuracy >= options.target) {
+        result.target_seconds = result.seconds;
+        result.target_samples = trained;
+      }
+    }
+  }
+
+  result.samples_per_sec = (result.seconds > 0) ? trained / result.seconds : 0;
+  result.peak_rss = bench_peak_rss();
+  result.step_allocations = (steps > 0) ? (double) allocations / steps : 0;
+  result.peak_matrix_bytes = memory_stats().peak_bytes;
+  return result;
+}
+
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!options.parse(argc, argv)) return 1;
+  if (options.threads > 0) set_parallel_threads(options.threads);
+  if (options.numa) {
+    set_numa_enabled(true);
+    set_parallel_affinity(true);
+  }
+
+  trace_thread_name("main");
+  if (!options.trace_path.empty()) trace_start();
+
+  DsSynthetic train_set(options.train_count, 0);
+  DsSynthetic test_set(options.test_count, 1);
+
+  const std::vector<std::string> labels = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" };
+  const std::vector<Activation> relu_softmax = { Activation::RELU, Activation::RELU, Activation::SOFTMAX };
+
+  // Smallest first, the peak memory of the process only grows.
+  std::vector<std::pair<std::string, NN>> models;
+  models.emplace_back("784-20-10-10", NN({ 784, 20, 10, 10 }, labels, relu_softmax, WeightInit::HE));
+  models.emplace_back("784-128-64-10", NN({ 784, 128, 64, 10 }, labels, relu_softmax, WeightInit::HE));
+  models.emplace_back("784-256-128-10", NN({ 784, 256, 128, 10 }, labels, relu_softmax, WeightInit::HE));
+  models.emplace_back("conv8-pool-10", NN({
+      LayerConfig::input(1, 28, 28),
+      LayerConfig::conv2d(8, 5, Activation::RELU, 2),
+      LayerConfig::max_pool(2),
+      LayerConfig::dense(10, Activation::SOFTMAX),
+    }, labels, WeightInit::HE));
+
+  std::map<std::string, double> baseline;
+  if (!options.baseline_path.empty() &&
+      !bench_read_json(options.baseline_path.c_str(), "samples_per_sec", baseline)) {
+    fprintf(stderr, "Cannot read the baseline %s\n", options.baseline_path.c_str());
+    return 1;
+  }
+
+  printf("%d samples per model (batch %d), %d train / %d test samples, target %.0f%%, blas: %s, threads: %d%s\n\n",
+         options.samples, options.batch, options.train_count, options.test_count,
+         options.target * 100, blas_backend_name(), parallel_threads(),
+         (options.numa) ? (", numa nodes: " + std::to_string(numa_nodes())).c_str() : "");
+  printf("%-16s %10s %12s %10s %16s %10s %10s %12s %12s\n", "model", "params", "samples/s", "train (s)",
+         "to target (s)", "accuracy", "peak MiB", "matrix MiB", "allocs/step");
+
+  std::vector<BenchRecord> records;
+  int regressions = 0;
+
+  for (auto& [name, nn] : models) {
+    if (!options.filter.empty() && name.find(options.filter) == std::string::npos) continue;
+
+    TrainResult r = train(nn, train_set, test_set, options);
+    char to_target[32] = "-";
+    if (r.target_seconds >= 0) snprintf(to_target, sizeof(to_target), "%.2f (%d)", r.target_seconds, r.target_samples);
+    printf("%-16s %10lld %12.0f %10.2f %16s %9.2f%% %10.1f %12.2f %12.1f", name.c_str(),
+           (long long) nn.parameter_count(), r.samples_per_sec, r.seconds, to_target, r.accuracy * 100,
+           r.peak_rss / (1024. * 1024.), r.peak_matrix_bytes / (1024. * 1024.), r.step_allocations);
+
+    auto it = baseline.find(name);
+    if (it != baseline.end() && it->second > 0) {
+      double change = r.samples_per_sec / it->second - 1;
+      bool regressed = change < -options.tolerance;
+      if (regressed) regressions++;
+      printf("   %+.1f%% vs baseline%s", change * 100, regressed ? " REGRESSED" : "");
+    }
+    printf("\n");
+    PROFILE_ONLY(nn.graph.profile().print(); printf("\n");)
+    if (!memory_site_stats().empty()) {
+      memory_print_sites();
+      printf("\n");
+    }
+    fflush(stdout);
+
+    records.push_back({ name, {
+      { "samples", (double) options.samples }, { "batch", (double) options.batch },
+      { "samples_per_sec", r.samples_per_sec }, { "train_seconds", r.seconds },
+      { "target_accuracy", options.target }, { "target_seconds", r.target_seconds },
+      { "target_samples", (double) r.target_samples }, { "accuracy", r.accuracy },
+      { "peak_rss_bytes", (double) r.peak_rss },
+      { "peak_matrix_bytes", (double) r.peak_matrix_bytes },
+      { "step_allocations", r.step_allocations },
+    }});
+  }
+
+  if (!options.trace_path.empty()) {
+    trace_stop();
+    if (!trace_write(options.trace_path.c_str())) {
+      fprintf(stderr, "Cannot write %s\n", options.trace_path.c_str());
+      return 1;
+    }
+    printf("\nTrace written to %s\n", options.trace_path.c_str());
+  }
+
+  if (!options.json_path.empty()) {
+    std::vector<std::pair<std::string, std::string>> context = {
+      { "blas", blas_backend_name() },
+      { "threads", std::to_string(parallel_threads()) },
+      { "numa", (options.numa) ? std::to_string(numa_nodes()) : "off" },
+      { "matrix_t_bytes", std::to_string(sizeof(matrix_t)) },
+    };
+    if (!bench_write_json(options.json_path.c_str(), "train-bench", context, records)) {
+      fprintf(stderr, "Cannot write %s\n", options.json_path.c_str());
+      return 1;
+    }
+    printf("\nResults written to %s\n", options.json_path.c_str());
+  }
+
+  if (regressions > 0) {
+    printf("\n%d model(s) regressed more than %.0f%% of the baseline throughput\n",
+           regressions, options.tolerance * 100);
+    return 1;
+  }
+  return 0;
+}
@@ -16,6 +16,26 @@ local dir_bin_raylib     = dir_build .. "/bin/%{cfg.buildcfg}/raylib"
 local dir_bin_thirdparty = dir_build .. "/bin/%{cfg.buildcfg}/thirdparty"
 local dir_bin_project    = dir_build .. "/bin/%{cfg.buildcfg}/" .. project_name
 
+-- ---------------------------------------------------------------------------
+-- Options
+-- ---------------------------------------------------------------------------
+
+newoption {
+  trigger     = "native",
+  description = "Compile for the host cpu (enables the F16C / AVX2 / AVX512 kernels)",
+}
+
+newoption {
+  trigger     = "profile",
+  description = "Record the per layer timing counters of the training (NN_PROFILE)",
+}
+
+newoption {
+  trigger     = "cblas",
+  value       = "LIB",
+  description = "Route gemm / axpy to a system cblas library (ex: openblas, mkl_rt)",
+}
+
 -- ---------------------------------------------------------------------------
 -- Workspace
 -- ---------------------------------------------------------------------------
@@ -145,11 +165,8 @@ project "raylib"
 -- Main Project
 -- ---------------------------------------------------------------------------
 
-project (project_name)
-  kind "ConsoleApp"
-  language "C++"
-  location (dir_build)
-  targetdir (dir_bin_project)
+-- Configurations and options shared by the main project and the benchmarks.
+function project_defaults()
 
   filter "configurations:Debug"
     defines { "DEBUG" }
@@ -163,8 +180,36 @@ project (project_name)
     defines{"_WINSOCK_DEPRECATED_NO_WARNINGS", "_CRT_SECURE_NO_WARNINGS"}
     characterset ("MBCS")
 
+  filter { "options:native", "action:vs*" }
+    vectorextensions "AVX2"
+
+  filter { "options:native", "not action:vs*" }
+    buildoptions { "-march=native" }
+
+  filter "options:profile"
+    defines { "NN_PROFILE" }
+
   filter {}
 
+  if _OPTIONS["cblas"] then
+    defines { "USE_CBLAS" }
+    links { _OPTIONS["cblas"] }
+  end
+
+  includedirs {
+    root_dir_rel .. "/src/",
+  }
+end
+
+
+project (project_name)
+  kind "ConsoleApp"
+  language "C++"
+  location (dir_build)
+  targetdir (dir_bin_project)
+
+  project_defaults()
+
   files {
     root_dir_rel .. "/src/**.c",
     root_dir_rel .. "/src/**.h",
@@ -172,10 +217,6 @@ project (project_name)
     root_dir_rel .. "/src/**.hpp",
   }
 
-  includedirs {
-    root_dir_rel .. "/src/",
-  }
-
   -- Enable if needed.
   -- buildoptions { "-Wall" }
 
@@ -184,6 +225,73 @@ project (project_name)
   link_raylib()
 
 
+-- ---------------------------------------------------------------------------
+-- Benchmarks
+-- ---------------------------------------------------------------------------
+
+-- Training benchmark of the conv net against the dense model on mnist, run
+-- from the build directory like the main project (for ../dataset).
+project "conv-bench"
+  kind "ConsoleApp"
+  language "C++"
+  location (dir_build)
+  targetdir (dir_bin_project)
+
+  project_defaults()
+
+  files {
+    root_dir_rel .. "/bench/conv_bench.cpp",
+  }
+
+  link_raylib()
+
+
+-- Micro benchmarks of the matrix operations, doesn't need raylib.
+--   nn-bench [--filter NAME] [--reps N] [--warmup N] [--min-time S] [--json PATH] [--threads N]
+project "nn-bench"
+  kind "ConsoleApp"
+  language "C++"
+  location (dir_build)
+  targetdir (dir_bin_project)
+
+  project_defaults()
+
+  files {
+    root_dir_rel .. "/bench/nn_bench.cpp",
+    root_dir_rel .. "/bench/bench.hpp",
+  }
+
+  filter "system:linux"
+    links { "pthread" }
+
+  filter {}
+
+
+-- Training throughput of the app model and larger ones on synthetic data,
+-- fails if it regressed from a baseline json.
+--   train-bench [--samples N] [--batch N] [--json PATH] [--baseline PATH] [--tolerance F] ...
+project "train-bench"
+  kind "ConsoleApp"
+  language "C++"
+  location (dir_build)
+  targetdir (dir_bin_project)
+
+  project_defaults()
+
+  files {
+    root_dir_rel .. "/bench/train_bench.cpp",
+    root_dir_rel .. "/bench/bench.hpp",
+  }
+
+  filter "system:linux"
+    links { "pthread" }
+
+  filter "system:windows"
+    links { "psapi" }
+
+  filter {}
+
+
 -- Copy files files after build.
 postbuildcommands {
   -- "cp " .. source_dir .. " " .. target_dir
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "matrix.hpp"
+
+// Slope of the leaky relu for the negative values.
+#define ACTIVATION_LEAKY_SLOPE 0.01f
+
+
+enum class Activation {
+  SIGMOID,
+  RELU,
+  LEAKY_RELU,
+  TANH,
+  SOFTMAX, // Of each row, only for the output layer (see NN::backprop).
+  LINEAR,  // Identity, f(x) = x.
+};
+
+
+const char* activation_name(Activation activation);
+
+
+// values = f(values).
+void activation_forward(Activation activation, MatrixView values);
+
+// delta *= f'(x) where outputs = f(x). The derivatives of all the activations
+// can be computed from their outputs, so the inputs don't have to be kept.
+// Not defined for softmax, its gradient is fused with the cross entropy.
+void activation_backward(Activation activation, ConstMatrixView outputs, MatrixView delta);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+// The kernels work a row at a time over contiguous memory, the relu ones are
+// branch free (select) loops which the compiler vectorizes, the cost of
+// sigmoid and tanh is the expf / tanhf call.
+
+
+const char* activation_name(Activation activation) {
+  switch (activation) {
+    case Activation::SIGMOID:    return "sigmoid";
+    case Activation::RELU:       return "relu";
+    case Activation::LEAKY_RELU: return "leaky_relu";
+    case Activation::TANH:       return "tanh";
+    case Activation::SOFTMAX:    return "softmax";
+    case Activation::LINEAR:     return "linear";
+  }
+  return "unknown";
+}
+
+
+void activation_forward(Activation activation, MatrixView values) {
+  const int n = values.cols();
+
+  for (int r = 0; r < values.rows(); r++) {
+    matrix_t* x = values.row_data(r);
+
+    switch (activation) {
+      case Activation::SIGMOID:
+        for (int i = 0; i < n; i++) x[i] = sigmoid(x[i]);
+        break;
+
+      case Activation::RELU:
+        for (int i = 0; i < n; i++) x[i] = (x[i] > 0) ? x[i] : 0;
+        break;
+
+      case Activation::LEAKY_RELU:
+        for (int i = 0; i < n; i++) x[i] = (x[i] > 0) ? x[i] : x[i] * ACTIVATION_LEAKY_SLOPE;
+        break;
+
+      case Activation::TANH:
+        for (int i = 0; i < n; i++) x[i] = tanhf(x[i]);
+        break;
+
+      // exp(x - max) / sum(exp(x - max)), subtracting the max of the row
+      // keeps expf from overflowing and doesn't change the result.
+      case Activation::SOFTMAX: {
+        matrix_t max = x[0];
+        for (int i = 1; i < n; i++) max = (x[i] > max) ? x[i] : max;
+        matrix_t sum = 0;
+        for (int i = 0; i < n; i++) {
+          x[i] = expf(x[i] - max);
+          sum += x[i];
+        }
+        matrix_t inv_sum = 1 / sum;
+        for (int i = 0; i < n; i++) x[i] *= inv_sum;
+      } break;
+
+      case Activation::LINEAR:
+        break;
+    }
+  }
+}
+
+
+void activation_backward(Activation activation, ConstMatrixView outputs, MatrixView delta) {
+  assert(outputs.rows() == delta.rows() && outputs.cols() == delta.cols());
+  const int n = delta.cols();
+
+  for (int r = 0; r < delta.rows(); r++) {
+    const matrix_t* a = outputs.row_data(r);
+    matrix_t* d = delta.row_data(r);
+
+    switch (activation) {
+      // a * (1 - a)
+      case Activation::SIGMOID:
+        for (int i = 0; i < n; i++) d[i] *= a[i] * (1 - a[i]);
+        break;
+
+      // a > 0 ? 1 : 0
+      case Activation::RELU:
+        for (int i = 0; i < n; i++) d[i] = (a[i] > 0) ? d[i] : 0;
+        break;
+
+      // a > 0 ? 1 : slope, the output has the same sign as the input.
+      case Activation::LEAKY_RELU:
+        for (int i = 0; i < n; i++) d[i] = (a[i] > 0) ? d[i] : d[i] * ACTIVATION_LEAKY_SLOPE;
+        break;
+
+      // 1 - a^2
+      case Activation::TANH:
+        for (int i = 0; i < n; i++) d[i] *= 1 - a[i] * a[i];
+        break;
+
+      case Activation::SOFTMAX:
+        assert(false && "Softmax is only supported in the output layer.");
+        break;
+
+      case Activation::LINEAR:
+        break;
+    }
+  }
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parallel.hpp"
+
+// The dense kernels (gemm, axpy) of matrix.hpp first offer the work to the
+// backend here. If the project is built with USE_CBLAS (premake --cblas=lib)
+// the float and double kernels are routed to the system cblas (OpenBLAS, MKL,
+// ...), otherwise the calls are declined and the built-in kernels are used,
+// so the default build has no dependencies.
+//
+// The matrices are row major and ld is the distance between rows, the same
+// as a MatrixView.
+//
+// The calls from a task of parallel_for() are declined as well, the library
+// would start its own threads on the cores the pool already uses (the
+// built-in kernels run serially in a task).
+
+// Problems smaller than this many multiply-adds are not worth the call
+// overhead of the library, they use the built-in kernels.
+#define BLAS_MIN_GEMM_FLOPS (32 * 32 * 32)
+#define BLAS_MIN_AXPY_SIZE  (4 * 1024)
+
+
+const char* blas_backend_name();
+
+// Enable or disable routing to the backend at runtime (to compare against
+// the built-in kernels), enabled by default if there is a backend.
+void blas_set_enabled(bool enabled);
+bool blas_is_enabled();
+
+// c = alpha * op(a) * op(b) + beta * c, where op(x) is x or x.transpose().
+// op(a) is (m x k), op(b) is (k x n) and c is (m x n). Returns false if the
+// backend didn't handle it.
+bool blas_gemm(bool trans_a, bool trans_b, int m, int n, int k,
+               float alpha, const float* a, int lda, const float* b, int ldb,
+               float beta, float* c, int ldc);
+bool blas_gemm(bool trans_a, bool trans_b, int m, int n, int k,
+               double alpha, const double* a, int lda, const double* b, int ldb,
+               double beta, double* c, int ldc);
+
+// y += alpha * x, returns false if the backend didn't handle it.
+bool blas_axpy(int n, float alpha, const float* x, float* y);
+bool blas_axpy(int n, double alpha, const double* x, double* y);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <atomic>
+
+#ifdef USE_CBLAS
+  #include <cblas.h>
+#endif
+
+
+static std::atomic<bool> _blas_enabled(true);
+
+
+const char* blas_backend_name() {
+#ifdef USE_CBLAS
+  return "cblas";
+#else
+  return "builtin";
+#endif
+}
+
+
+void blas_set_enabled(bool enabled) {
+  _blas_enabled.store(enabled);
+}
+
+
+bool blas_is_enabled() {
+#ifdef USE_CBLAS
+  return _blas_enabled.load(std::memory_order_relaxed);
+#else
+  return false;
+#endif
+}
+
+
+#ifdef USE_CBLAS
+
+static inline bool _blas_use_gemm(int m, int n, int k) {
+  return blas_is_enabled() && !parallel_in_task() && (double)m * n * k >= BLAS_MIN_GEMM_FLOPS;
+}
+
+
+static inline bool _blas_use_axpy(int n) {
+  return blas_is_enabled() && !parallel_in_task() && n >= BLAS_MIN_AXPY_SIZE;
+}
+
+
+bool blas_gemm(bool trans_a, bool trans_b, int m, int n, int k,
+               float alpha, const float* a, int lda, const float* b, int ldb,
+               float beta, float* c, int ldc) {
+  if (!_blas_use_gemm(m, n, k)) return false;
+  cblas_sgemm(CblasRowMajor,
+              (trans_a) ? CblasTrans : CblasNoTrans,
+              (trans_b) ? CblasTrans : CblasNoTrans,
+              m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+  return true;
+}
+
+
+bool blas_gemm(bool trans_a, bool trans_b, int m, int n, int k,
+               double alpha, const double* a, int lda, const double* b, int ldb,
+               double beta, double* c, int ldc) {
+  if (!_blas_use_gemm(m, n, k)) return false;
+  cblas_dgemm(CblasRowMajor,
+              (trans_a) ? CblasTrans : CblasNoTrans,
+              (trans_b) ? CblasTrans : CblasNoTrans,
+              m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+  return true;
+}
+
+
+bool blas_axpy(int n, float alpha, const float* x, float* y) {
+  if (!_blas_use_axpy(n)) return false;
+  cblas_saxpy(n, alpha, x, 1, y, 1);
+  return true;
+}
+
+
+bool blas_axpy(int n, double alpha, const double* x, double* y) {
+  if (!_blas_use_axpy(n)) return false;
+  cblas_daxpy(n, alpha, x, 1, y, 1);
+  return true;
+}
+
+#else // !USE_CBLAS
+
+bool blas_gemm(bool, bool, int, int, int, float, const float*, int, const float*, int, float, float*, int) {
+  return false;
+}
+
+
+bool blas_gemm(bool, bool, int, int, int, double, const double*, int, const double*, int, double, double*, int) {
+  return false;
+}
+
+
+bool blas_axpy(int, float, const float*, float*) {
+  return false;
+}
+
+
+bool blas_axpy(int, double, const double*, double*) {
+  return false;
+}
+
+#endif // USE_CBLAS
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,300 @@
+#pragma once
+
+#include "matrix.hpp"
+
+#include <algorithm>
+
+
+// Shape of the images of a layer. A sample is stored in a row of a matrix
+// channel after channel, and each channel row after row (CHW), so a dense
+// layer after a convolution just sees a row of channels * height * width.
+struct ImageShape {
+  int channels = 0;
+  int height = 1;
+  int width = 1;
+
+  int size() const { return channels * height * width; }
+};
+
+
+// A (kernel x kernel) window sliding over the input image with the stride,
+// the input is zero padded by padding on each side.
+struct ConvWindow {
+  ImageShape input;
+  int kernel = 1;
+  int stride = 1;
+  int padding = 0;
+
+  int out_height() const { return (input.height + 2 * padding - kernel) / stride + 1; }
+  int out_width() const { return (input.width + 2 * padding - kernel) / stride + 1; }
+  int positions() const { return out_height() * out_width(); }
+  int patch_size() const { return input.channels * kernel * kernel; }
+};
+
+
+enum class PoolType {
+  MAX,
+  AVG,
+};
+
+
+// Unfold the patches of the image into the columns of cols (patch_size x
+// positions), row (c * kernel + ky) * kernel + kx of a column is the pixel
+// at (ky, kx) of the channel c of the patch. With this the convolution of
+// all the filters is a single gemm.
+void im2col(const ConvWindow& window, const matrix_t* image, MatrixView cols);
+
+// The reverse of im2col, adds the values of the columns to their pixels of
+// the image (the overlapping patches are summed).
+void col2im(const ConvWindow& window, ConstMatrixView cols, matrix_t* image);
+
+// For each row (sample) of the input, output = weights.trans() * im2col(input)
+// + bias, where weights is (patch_size x filters), bias is (1 x filters) and
+// the output row is the filters * positions feature maps. cols is scratch
+// for the columns of a sample (patch_size x positions), it's given by the
+// caller so the calls don't allocate.
+void conv2d_forward(const ConvWindow& window, ConstMatrixView input,
+                    ConstMatrixView weights, ConstMatrixView bias, MatrixView output,
+                    MatrixView cols);
+
+// From the gradient of the outputs, set the gradients of the weights and the
+// bias (summed over the samples), and of the inputs if input_grad isn't an
+// empty view. cols and cols_grad are scratch like in conv2d_forward(),
+// cols_grad is only used with input_grad.
+void conv2d_backward(const ConvWindow& window, ConstMatrixView input,
+                     ConstMatrixView weights, ConstMatrixView output_grad,
+                     MatrixView weight_grad, MatrixView bias_grad, MatrixView input_grad,
+                     MatrixView cols, MatrixView cols_grad);
+
+// Max or average of each window of each channel, the padding is not part of
+// the window (not counted in the average).
+void pool_forward(PoolType type, const ConvWindow& window, ConstMatrixView input, MatrixView output);
+
+// The gradient of the outputs goes to the max input of each window (the
+// first one if there are equal values), or split evenly for the average.
+void pool_backward(PoolType type, const ConvWindow& window, ConstMatrixView input,
+                   ConstMatrixView output_grad, MatrixView input_grad);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+
+void im2col(const ConvWindow& window, const matrix_t* image, MatrixView cols) {
+  const int height = window.input.height, width = window.input.width;
+  const int out_height = window.out_height(), out_width = window.out_width();
+  const int kernel = window.kernel, stride = window.stride, padding = window.padding;
+  assert(cols.rows() == window.patch_size() && cols.cols() == out_height * out_width);
+
+  for (int c = 0; c < window.input.channels; c++) {
+    const matrix_t* channel = image + (size_t)c * height * width;
+
+    for (int ky = 0; ky < kernel; ky++) {
+      for (int kx = 0; kx < kernel; kx++) {
+        matrix_t* row = cols.row_data((c * kernel + ky) * kernel + kx);
+
+        for (int oy = 0; oy < out_height; oy++) {
+          matrix_t* out = row + (size_t)oy * out_width;
+          int y = oy * stride - padding + ky;
+          if (y < 0 || y >= height) {
+            for (int ox = 0; ox < out_width; ox++) out[ox] = 0;
+            continue;
+          }
+
+          const matrix_t* src = channel + (size_t)y * width;
+          if (stride == 1 && padding == 0) {
+            for (int ox = 0; ox < out_width; ox++) out[ox] = src[ox + kx];
+            continue;
+          }
+          for (int ox = 0; ox < out_width; ox++) {
+            int x = ox * stride - padding + kx;
+            out[ox] = (x >= 0 && x < width) ? src[x] : 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+void col2im(const ConvWindow& window, ConstMatrixView cols, matrix_t* image) {
+  const int height = window.input.height, width = window.input.width;
+  const int out_height = window.out_height(), out_width = window.out_width();
+  const int kernel = window.kernel, stride = window.stride, padding = window.padding;
+  assert(cols.rows() == window.patch_size() && cols.cols() == out_height * out_width);
+
+  for (int c = 0; c < window.input.channels; c++) {
+    matrix_t* channel = image + (size_t)c * height * width;
+
+    for (int ky = 0; ky < kernel; ky++) {
+      for (int kx = 0; kx < kernel; kx++) {
+        const matrix_t* row = cols.row_data((c * kernel + ky) * kernel + kx);
+
+        for (int oy = 0; oy < out_height; oy++) {
+          int y = oy * stride - padding + ky;
+          if (y < 0 || y >= height) continue;
+
+          const matrix_t* src = row + (size_t)oy * out_width;
+          matrix_t* dst = channel + (size_t)y * width;
+          for (int ox = 0; ox < out_width; ox++) {
+            int x = ox * stride - padding + kx;
+            if (x >= 0 && x < width) dst[x] += src[ox];
+          }
+        }
+      }
+    }
+  }
+}
+
+
+void conv2d_forward(const ConvWindow& window, ConstMatrixView input,
+                    ConstMatrixView weights, ConstMatrixView bias, MatrixView output,
+                    MatrixView cols) {
+  const int positions = window.positions();
+  const int filters = weights.cols();
+  assert(input.cols() == window.input.size());
+  assert(weights.rows() == window.patch_size());
+  assert(bias.rows() == 1 && bias.cols() == filters);
+  assert(output.rows() == input.rows() && output.cols() == filters * positions);
+  assert(cols.rows() == window.patch_size() && cols.cols() == positions);
+
+  for (int r = 0; r < input.rows(); r++) {
+    im2col(window, input.row_data(r), cols);
+
+    // The output of the sample as (filters x positions).
+    MatrixView out(output.row_data(r), filters, positions);
+    gemm<matrix_t>(weights, cols, out, 1, 0, true, false);
+
+    for (int f = 0; f < filters; f++) {
+      matrix_t b = bias.at(0, f);
+      matrix_t* row = out.row_data(f);
+      for (int i = 0; i < positions; i++) row[i] += b;
+    }
+  }
+}
+
+
+void conv2d_backward(const ConvWindow& window, ConstMatrixView input,
+                     ConstMatrixView weights, ConstMatrixView output_grad,
+                     MatrixView weight_grad, MatrixView bias_grad, MatrixView input_grad,
+                     MatrixView cols, MatrixView cols_grad) {
+  const int positions = window.positions();
+  const int filters = weights.cols();
+  const bool has_input_grad = input_grad.data() != nullptr;
+  assert(output_grad.rows() == input.rows() && output_grad.cols() == filters * positions);
+  assert(weight_grad.rows() == weights.rows() && weight_grad.cols() == filters);
+  assert(bias_grad.rows() == 1 && bias_grad.cols() == filters);
+  assert(!has_input_grad || (input_grad.rows() == input.rows() && input_grad.cols() == input.cols()));
+  assert(cols.rows() == window.patch_size() && cols.cols() == positions);
+  assert(!has_input_grad || (cols_grad.rows() == cols.rows() && cols_grad.cols() == positions));
+
+  weight_grad.fill(0);
+  bias_grad.fill(0);
+  if (has_input_grad) input_grad.fill(0);
+
+  for (int r = 0; r < input.rows(); r++) {
+    ConstMatrixView grad(output_grad.row_data(r), filters, positions);
+
+    // weight_grad += cols * grad.trans()
+    im2col(window, input.row_data(r), cols);
+    gemm<matrix_t>(cols, grad, weight_grad, 1, 1, false, true);
+
+    for (int f = 0; f < filters; f++) {
+      bias_grad.set(0, f, bias_grad.at(0, f) + grad.row(f).sum());
+    }
+
+    // input_grad = col2im(weights * grad)
+    if (has_input_grad) {
+      gemm<matrix_t>(weights, grad, cols_grad, 1, 0, false, false);
+      col2im(window, cols_grad, input_grad.row_data(r));
+    }
+  }
+}
+
+
+void pool_forward(PoolType type, const ConvWindow& window, ConstMatrixView input, MatrixView output) {
+  const int channels = window.input.channels;
+  const int height = window.input.height, width = window.input.width;
+  const int out_height = window.out_height(), out_width = window.out_width();
+  assert(input.cols() == window.input.size());
+  assert(output.rows() == input.rows() && output.cols() == channels * out_height * out_width);
+  assert(window.padding < window.kernel);
+
+  for (int r = 0; r < input.rows(); r++) {
+    const matrix_t* image = input.row_data(r);
+    matrix_t* out = output.row_data(r);
+
+    for (int c = 0; c < channels; c++) {
+      const matrix_t* channel = image + (size_t)c * height * width;
+
+      for (int oy = 0; oy < out_height; oy++) {
+        for (int ox = 0; ox < out_width; ox++) {
+          int y0 = oy * window.stride - window.padding;
+          int x0 = ox * window.stride - window.padding;
+
+          matrix_t value = (type == PoolType::MAX) ? -INFINITY : 0;
+          int count = 0;
+          for (int y = std::max(y0, 0); y < std::min(y0 + window.kernel, height); y++) {
+            for (int x = std::max(x0, 0); x < std::min(x0 + window.kernel, width); x++) {
+              matrix_t v = channel[y * width + x];
+              if (type == PoolType::MAX) value = (v > value) ? v : value;
+              else value += v;
+              count++;
+            }
+          }
+          if (type == PoolType::AVG) value /= count;
+          *out++ = value;
+        }
+      }
+    }
+  }
+}
+
+
+void pool_backward(PoolType type, const ConvWindow& window, ConstMatrixView input,
+                   ConstMatrixView output_grad, MatrixView input_grad) {
+  const int channels = window.input.channels;
+  const int height = window.input.height, width = window.input.width;
+  const int out_height = window.out_height(), out_width = window.out_width();
+  assert(output_grad.rows() == input.rows() && output_grad.cols() == channels * out_height * out_width);
+  assert(input_grad.rows() == input.rows() && input_grad.cols() == input.cols());
+
+  input_grad.fill(0);
+
+  for (int r = 0; r < input.rows(); r++) {
+    const matrix_t* image = input.row_data(r);
+    const matrix_t* grad = output_grad.row_data(r);
+    matrix_t* image_grad = input_grad.row_data(r);
+
+    for (int c = 0; c < channels; c++) {
+      const matrix_t* channel = image + (size_t)c * height * width;
+      matrix_t* channel_grad = image_grad + (size_t)c * height * width;
+
+      for (int oy = 0; oy < out_height; oy++) {
+        for (int ox = 0; ox < out_width; ox++) {
+          int y0 = oy * window.stride - window.padding, y1 = std::min(y0 + window.kernel, height);
+          int x0 = ox * window.stride - window.padding, x1 = std::min(x0 + window.kernel, width);
+          y0 = std::max(y0, 0); x0 = std::max(x0, 0);
+          matrix_t g = *grad++;
+
+          if (type == PoolType::MAX) {
+            int max_index = y0 * width + x0;
+            for (int y = y0; y < y1; y++) {
+              for (int x = x0; x < x1; x++) {
+                if (channel[y * width + x] > channel[max_index]) max_index = y * width + x;
+              }
+            }
+            channel_grad[max_index] += g;
+
+          } else {
+            g /= (y1 - y0) * (x1 - x0);
+            for (int y = y0; y < y1; y++) {
+              for (int x = x0; x < x1; x++) channel_grad[y * width + x] += g;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,631 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "activation.hpp"
+#include "conv.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <fstream>
+
+
+enum class NodeType {
+  DENSE,
+  CONV2D,
+  MAX_POOL,
+  AVG_POOL,
+  ACTIVATION,
+  DROPOUT,
+  LAYER_NORM,
+};
+
+
+const char* node_type_name(NodeType type);
+
+
+// How the weights are initialized, fan_in is the number of inputs of a
+// neuron and fan_out the number of neurons using an input.
+enum class WeightInit {
+  UNIFORM, // Uniform in [-0.5, 0.5].
+  XAVIER,  // Uniform in +/- sqrt(6 / (fan_in + fan_out)), for sigmoid / tanh.
+  HE,      // Normal with stddev sqrt(2 / fan_in), for relu.
+};
+
+
+// A trainable matrix of a node and the matrix its gradient is written to by
+// the backward pass.
+struct Parameter {
+  Matrix* value;
+  Matrix* grad;
+};
+
+
+// Scratch memory of Graph::predict(), the outputs of all the steps live in
+// it at the offsets planned by Graph::compile(). Keep one per thread and
+// pass it to every predict() so the inference loop doesn't allocate.
+struct InferenceWorkspace {
+  AlignedBuffer<matrix_t> buffer;
+  AlignedBuffer<matrix_t> scratch; // Temporaries of a node (the im2col of a convolution).
+};
+
+
+// An operation of the graph. It maps a batch of inputs (a sample per row) to
+// a batch of outputs, and owns its parameters. The graph owns the buffers,
+// so a node only sees views of them.
+class Node {
+public:
+  virtual ~Node() = default;
+
+  virtual NodeType type() const = 0;
+
+  // Set the shape of the inputs and allocate the parameters (unless they're
+  // already of the right shape, ie. loaded), returns the shape of the outputs.
+  virtual ImageShape build(const ImageShape& input) = 0;
+
+  // Initialize the parameters after build().
+  virtual void init(WeightInit /*init*/, const Rng& /*rng*/) {}
+
+  // output = f(input) of the inference, it doesn't modify the node so it can
+  // be called from multiple threads.
+  virtual void forward(ConstMatrixView input, MatrixView output) const = 0;
+
+  // forward() with the scratch memory of the workspace of the calling
+  // thread, for the nodes which need temporaries. Used by Graph::predict().
+  virtual void forward_scratch(ConstMatrixView input, MatrixView output,
+                               InferenceWorkspace& /*workspace*/) const {
+    forward(input, output);
+  }
+
+  // The forward pass of the training, which can differ from the inference
+  // (dropout) and keep what the backward pass needs.
+  virtual void forward_train(ConstMatrixView input, MatrixView output) { forward(input, output); }
+
+  // From the gradient of the outputs, write the gradients of the parameters
+  // and of the inputs if input_grad isn't an empty view.
+  virtual void backward(ConstMatrixView input, ConstMatrixView output,
+                        ConstMatrixView output_grad, MatrixView input_grad) = 0;
+
+  // Append the parameters, the order is the index of their optimizer state.
+  virtual void parameters(std::vector<Parameter>& /*params*/) {}
+
+  // Floating point operations of the forward pass of a sample.
+  virtual int64_t flops() const { return 0; }
+
+  // If the node only applies an activation, returns it so it can be fused
+  // into the node before it, otherwise linear.
+  virtual Activation activation() const { return Activation::LINEAR; }
+
+  // The output can be written over the input. These nodes don't read the
+  // input in backward() since it's overwritten.
+  virtual bool in_place() const { return false; }
+
+  // backward() reads the outputs, so they can't be overwritten in place by
+  // the next node.
+  virtual bool needs_output() const { return false; }
+
+  // The configuration and the parameters, the type is written by the caller.
+  virtual void save(std::ofstream& /*file*/) const {}
+  virtual void load(std::ifstream& /*file*/) {}
+};
+
+
+// A chain of nodes. compile() turns the nodes into steps:
+//
+//   - An activation node is fused into the step before it, the activation is
+//     applied to the output buffer of the step right after it's written,
+//     instead of a separate pass over another buffer.
+//   - Every step gets an output buffer, except the in place nodes (dropout,
+//     activations that couldn't be fused) which reuse their input buffer
+//     when nothing else needs it.
+//   - The gradients of the backward pass ping-pong between two buffers.
+//   - The inference doesn't keep the outputs, each one is dead once the
+//     next step read it. The outputs are assigned to slots of a workspace by
+//     their lifetimes (a slot is reused once its value is dead) so the
+//     memory is the peak of the live outputs instead of their sum, and the
+//     last output is written directly to the caller's matrix.
+//
+// so a new node type only implements Node, the forward / backward loops
+// never change.
+class Graph {
+public:
+  // Append a node, compile() should be called before the graph is used.
+  void add(std::unique_ptr<Node> node);
+
+  // Build the nodes for the input shape, fuse and plan the buffers.
+  void compile(const ImageShape& input);
+
+  // The training forward pass, the outputs of all the steps are kept for
+  // backward(). Returns the outputs of the graph.
+  const Matrix& forward(ConstMatrixView input);
+
+  // The inference forward pass which doesn't modify the graph (thread safe).
+  void predict(ConstMatrixView input, MatrixView output, InferenceWorkspace& workspace) const;
+  Matrix predict(ConstMatrixView input) const;
+
+  // Bytes of the workspace of predict() for a batch, and of the outputs kept
+  // by the training forward().
+  size_t inference_bytes(int rows) const;
+  size_t training_bytes(int rows) const;
+
+  // delta is the gradient of the loss with respect to the outputs before the
+  // last activation (the gradient of the softmax / sigmoid is fused with the
+  // loss, see NN::backprop()). The gradients are written to the parameters.
+  void backward(ConstMatrixView delta);
+
+  // The parameters in the order of the nodes.
+  const std::vector<Parameter>& parameters() const { return _parameters; }
+
+  // The activation of the outputs of the graph.
+  Activation output_activation() const;
+  ImageShape output_shape() const;
+
+  int64_t flops() const;
+  int64_t parameter_count() const;
+
+  // The values of the graph as layers for displaying, 0 is the input and
+  // layer i is the outputs of the step i - 1 (after its activation). The node
+  // is the one computing the layer, null for the input.
+  int layer_count() const { return (int) _steps.size() + 1; }
+  const Matrix& layer_outputs(int layer) const;
+  const Node* layer_node(int layer) const;
+
+  // Index in parameters() of the first parameter of the node of the layer,
+  // -1 if it has none (ex: the weights of a dense node, then its biases).
+  int layer_parameter(int layer) const;
+
+  // The counters of each step of forward() and backward() since the last
+  // reset, the layers are empty unless compiled with NN_PROFILE.
+  GraphProfile& profile() { return _profile; }
+  const GraphProfile& profile() const { return _profile; }
+
+  std::vector<std::unique_ptr<Node>> nodes;
+  ImageShape input_shape;
+
+private:
+  struct Step {
+    Node* node;
+    Activation activation; // Fused.
+    ImageShape shape;      // Of the outputs.
+    int input;             // Index of the buffers.
+    int output;
+    int64_t parameters;    // Values of the parameters of the node.
+    int first_parameter;   // Index in _parameters, -1 if none.
+  };
+
+  // The slots of the outputs of the steps for predict(), the offset and
+  // size of a slot are per sample.
+  struct InferencePlan {
+    enum {
+      INPUT = -1,  // The input of predict().
+      OUTPUT = -2, // The output of predict().
+    };
+
+    std::vector<int> inputs;  // Slot of each step.
+    std::vector<int> outputs;
+    std::vector<size_t> slot_offsets;
+    size_t sample_size = 0;   // Of all the slots.
+  };
+
+  void _plan_inference();
+
+  // Add a call of the step to the profile.
+  void _profile_forward(int step, double ns, int64_t allocations);
+  void _profile_backward(int step, double ns, int64_t allocations);
+
+  std::vector<Step> _steps;
+  std::vector<Matrix> _buffers; // 0 is the input.
+  Matrix _deltas[2];
+  std::vector<Parameter> _parameters;
+  InferencePlan _plan;
+  GraphProfile _profile;
+  bool _compiled = false;
+};
+
+
+void write_matrix(std::ofstream& file, const Matrix& m);
+Matrix read_matrix(std::ifstream& file);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+
+// Resize to (rows x cols) only if it's not already, so the values of the
+// matrix are kept.
+static void _graph_reshape(Matrix& m, int rows, int cols) {
+  if (m.rows() != rows || m.cols() != cols) m.init(rows, cols);
+}
+
+
+const char* node_type_name(NodeType type) {
+  switch (type) {
+    case NodeType::DENSE:      return "dense";
+    case NodeType::CONV2D:     return "conv2d";
+    case NodeType::MAX_POOL:   return "max_pool";
+    case NodeType::AVG_POOL:   return "avg_pool";
+    case NodeType::ACTIVATION: return "activation";
+    case NodeType::DROPOUT:    return "dropout";
+    case NodeType::LAYER_NORM: return "layer_norm";
+  }
+  return "unknown";
+}
+
+
+void Graph::add(std::unique_ptr<Node> node) {
+  nodes.push_back(std::move(node));
+  _compiled = false;
+}
+
+
+void Graph::compile(const ImageShape& input) {
+  input_shape = input;
+  _steps.clear();
+  _buffers.clear();
+  _buffers.resize(1);
+  _buffers[0].init(1, input.size());
+
+  ImageShape shape = input;
+  for (std::unique_ptr<Node>& node : nodes) {
+    shape = node->build(shape);
+
+    if (!_steps.empty()) {
+      Step& prev = _steps.back();
+
+      if (node->activation() != Activation::LINEAR && prev.activation == Activation::LINEAR) {
+        prev.activation = node->activation();
+        continue;
+      }
+    }
+
+    Step step;
+    step.node = node.get();
+    step.activation = Activation::LINEAR;
+    step.shape = shape;
+    step.input = (_steps.empty()) ? 0 : _steps.back().output;
+
+    // The input buffer can be overwritten if the step which wrote it doesn't
+    // need it for backward, the graph input is kept for displaying.
+    bool in_place = node->in_place() && !_steps.empty() &&
+                    _steps.back().activation == Activation::LINEAR &&
+                    !_steps.back().node->needs_output();
+
+    if (in_place) {
+      step.output = step.input;
+    } else {
+      step.output = (int) _buffers.size();
+      _buffers.push_back(Matrix(1, shape.size()));
+    }
+    _steps.push_back(step);
+  }
+
+  for (size_t i = 0; i + 1 < _steps.size(); i++) {
+    assert(_steps[i].activation != Activation::SOFTMAX &&
+           _steps[i].node->activation() != Activation::SOFTMAX &&
+           "Softmax is only supported in the output layer.");
+  }
+
+  _parameters.clear();
+  for (std::unique_ptr<Node>& node : nodes) node->parameters(_parameters);
+
+  for (Step& step : _steps) {
+    std::vector<Parameter> params;
+    step.node->parameters(params);
+    step.parameters = 0;
+    for (const Parameter& param : params) step.parameters += param.value->data().size();
+
+    step.first_parameter = -1;
+    for (size_t i = 0; i < _parameters.size() && !params.empty(); i++) {
+      if (_parameters[i].value == params[0].value) {
+        step.first_parameter = (int) i;
+        break;
+      }
+    }
+  }
+
+  PROFILE_ONLY(
+    _profile = GraphProfile();
+    for (const Step& step : _steps) {
+      LayerProfile layer;
+      layer.name = node_type_name(step.node->type());
+      if (step.activation != Activation::LINEAR) layer.name += std::string("+") + activation_name(step.activation);
+      _profile.layers.push_back(layer);
+    }
+  )
+
+  _plan_inference();
+  _compiled = true;
+}
+
+
+// The value written by a step lives until the last step reading it (or
+// writing it in place), the values are assigned in order to the free slot
+// which fits them best, and a slot grows to the largest value it hosts.
+void Graph::_plan_inference() {
+  const int step_count = (int) _steps.size();
+  _plan = InferencePlan();
+  if (step_count == 0) return;
+
+  // The value of each step is the index of the step which allocated it, the
+  // input of predict() is read only so the first step can't be in place.
+  std::vector<int> values(step_count);
+  std::vector<int> last_use(step_count);
+  for (int i = 0; i < step_count; i++) {
+    bool in_place = i > 0 && _steps[i].node->in_place();
+    values[i] = (in_place) ? values[i - 1] : i;
+    last_use[values[i]] = i;
+    if (i > 0) last_use[values[i - 1]] = i;
+  }
+  const int output_value = values[step_count - 1];
+
+  std::vector<int> slot_of(step_count, InferencePlan::OUTPUT);
+  std::vector<size_t> slot_sizes;
+  std::vector<int> slot_value; // The value in each slot, -1 if it's free.
+
+  for (int v = 0; v < step_count; v++) {
+    if (values[v] != v || v == output_value) continue;
+
+    for (size_t slot = 0; slot < slot_value.size(); slot++) {
+      if (slot_value[slot] >= 0 && last_use[slot_value[slot]] < v) slot_value[slot] = -1;
+    }
+
+    // The smallest free slot large enough, or grow the largest one.
+    const size_t size = _steps[v].shape.size();
+    int best = -1;
+    for (int slot = 0; slot < (int) slot_value.size(); slot++) {
+      if (slot_value[slot] >= 0) continue;
+      if (best < 0) { best = slot; continue; }
+      bool fits = slot_sizes[slot] >= size, best_fits = slot_sizes[best] >= size;
+      if (fits && (!best_fits || slot_sizes[slot] < slot_sizes[best])) best = slot;
+      if (!fits && !best_fits && slot_sizes[slot] > slot_sizes[best]) best = slot;
+    }
+    if (best < 0) {
+      best = (int) slot_value.size();
+      slot_value.push_back(-1);
+      slot_sizes.push_back(0);
+    }
+    slot_value[best] = v;
+    slot_sizes[best] = std::max(slot_sizes[best], size);
+    slot_of[v] = best;
+  }
+
+  // Each slot starts at a cache line for any number of rows.
+  const size_t line = MEMORY_ALIGNMENT / sizeof(matrix_t);
+  for (size_t size : slot_sizes) {
+    _plan.slot_offsets.push_back(_plan.sample_size);
+    _plan.sample_size += (size + line - 1) / line * line;
+  }
+
+  for (int i = 0; i < step_count; i++) {
+    _plan.inputs.push_back((i == 0) ? InferencePlan::INPUT : slot_of[values[i - 1]]);
+    _plan.outputs.push_back(slot_of[values[i]]);
+  }
+}
+
+
+const Matrix& Graph::forward(ConstMatrixView input) {
+  assert(_compiled && "The graph should be compiled before it's used.");
+  assert(input.cols() == input_shape.size());
+
+  const int rows = input.rows();
+  _graph_reshape(_buffers[0], rows, input.cols());
+  MatrixView(_buffers[0]).assign(input);
+
+  for (int i = 0; i < (int) _steps.size(); i++) {
+    const Step& step = _steps[i];
+    PROFILE_ONLY(ProfileTimer timer; int64_t allocations = MemoryPool::allocations();)
+
+    Matrix& output = _buffers[step.output];
+    if (step.output != step.input) _graph_reshape(output, rows, step.shape.size());
+
+    step.node->forward_train(_buffers[step.input], output);
+    if (step.activation != Activation::LINEAR) activation_forward(step.activation, output);
+
+    PROFILE_ONLY(_profile_forward(i, timer.ns(), MemoryPool::allocations() - allocations);)
+  }
+
+  return _buffers[(_steps.empty()) ? 0 : _steps.back().output];
+}
+
+
+void Graph::predict(ConstMatrixView input, MatrixView output, InferenceWorkspace& workspace) const {
+  assert(_compiled && "The graph should be compiled before it's used.");
+  assert(input.cols() == input_shape.size());
+  assert(output.rows() == input.rows() && output.cols() == output_shape().size());
+
+  const int rows = input.rows();
+  if (_steps.empty()) {
+    output.assign(input);
+    return;
+  }
+
+  workspace.buffer.resize(rows * _plan.sample_size);
+  auto slot_view = [&](int slot, int cols) {
+    if (slot == InferencePlan::OUTPUT) return output;
+    return MatrixView(workspace.buffer.data() + rows * _plan.slot_offsets[slot], rows, cols);
+  };
+
+  for (size_t i = 0; i < _steps.size(); i++) {
+    const Step& step = _steps[i];
+    ConstMatrixView in = (i == 0)
+      ? input
+      : ConstMatrixView(slot_view(_plan.inputs[i], _steps[i - 1].shape.size()));
+    MatrixView out = slot_view(_plan.outputs[i], step.shape.size());
+
+    step.node->forward_scratch(in, out, workspace);
+    if (step.activation != Activation::LINEAR) activation_forward(step.activation, out);
+  }
+}
+
+
+Matrix Graph::predict(ConstMatrixView input) const {
+  Matrix output(input.rows(), output_shape().size());
+  InferenceWorkspace workspace;
+  predict(input, output, workspace);
+  return output;
+}
+
+
+size_t Graph::inference_bytes(int rows) const {
+  return rows * _plan.sample_size * sizeof(matrix_t);
+}
+
+
+size_t Graph::training_bytes(int rows) const {
+  size_t size = 0;
+  for (const Matrix& buffer : _buffers) size += buffer.cols();
+  return rows * size * sizeof(matrix_t);
+}
+
+
+void Graph::backward(ConstMatrixView delta) {
+  assert(_compiled && "The graph should be compiled before it's used.");
+  assert(delta.rows() == _buffers[0].rows() && delta.cols() == output_shape().size());
+
+  const int rows = delta.rows();
+  int curr = 0;
+  _graph_reshape(_deltas[curr], rows, delta.cols());
+  MatrixView(_deltas[curr]).assign(delta);
+
+  for (int i = (int) _steps.size() - 1; i >= 0; i--) {
+    const Step& step = _steps[i];
+    const bool last = i == (int) _steps.size() - 1;
+    Matrix& grad = _deltas[curr];
+    Matrix& input_grad = _deltas[1 - curr];
+    const Matrix& output = _buffers[step.output];
+    const Matrix& input = _buffers[step.input];
+    PROFILE_ONLY(ProfileTimer timer; int64_t allocations = MemoryPool::allocations();)
+
+    // The inputs of the first step are the data, they don't need a delta.
+    const bool has_input_grad = i > 0;
+    if (has_input_grad) _graph_reshape(input_grad, rows, input.cols());
+
+    // The delta of the graph is already of the values before the last
+    // activation.
+    if (!last && step.activation != Activation::LINEAR) {
+      activation_backward(step.activation, output, grad);
+    }
+
+    if (last && step.node->type() == NodeType::ACTIVATION) {
+      if (has_input_grad) input_grad = grad;
+    } else {
+      step.node->backward(input, output, grad, (has_input_grad) ? MatrixView(input_grad) : MatrixView());
+    }
+
+    PROFILE_ONLY(_profile_backward(i, timer.ns(), MemoryPool::allocations() - allocations);)
+    curr = 1 - curr;
+  }
+}
+
+
+void Graph::_profile_forward(int step, double ns, int64_t allocations) {
+  const Step& s = _steps[step];
+  const int64_t rows = _buffers[0].rows();
+  const int64_t values = rows * (_buffers[s.input].cols() + s.shape.size()) + s.parameters;
+
+  LayerProfile& layer = _profile.layers[step];
+  layer.forward_calls++;
+  layer.forward_ns += ns;
+  layer.flops += rows * s.node->flops();
+  layer.bytes += values * (int64_t) sizeof(matrix_t);
+  layer.allocations += allocations;
+}
+
+
+// The inputs, outputs and both deltas are read or written, and the
+// parameters are read and their gradients written.
+void Graph::_profile_backward(int step, double ns, int64_t allocations) {
+  const Step& s = _steps[step];
+  const int64_t rows = _buffers[0].rows();
+  const int64_t values = 2 * rows * (_buffers[s.input].cols() + s.shape.size()) + 2 * s.parameters;
+
+  LayerProfile& layer = _profile.layers[step];
+  layer.backward_calls++;
+  layer.backward_ns += ns;
+  layer.flops += 2 * rows * s.node->flops();
+  layer.bytes += values * (int64_t) sizeof(matrix_t);
+  layer.allocations += allocations;
+}
+
+
+Activation Graph::output_activation() const {
+  if (_steps.empty()) return Activation::LINEAR;
+  const Step& step = _steps.back();
+  if (step.node->type() == NodeType::ACTIVATION) return step.node->activation();
+  return step.activation;
+}
+
+
+ImageShape Graph::output_shape() const {
+  return (_steps.empty()) ? input_shape : _steps.back().shape;
+}
+
+
+int64_t Graph::flops() const {
+  int64_t flops = 0;
+  for (const std::unique_ptr<Node>& node : nodes) flops += node->flops();
+  return flops;
+}
+
+
+int64_t Graph::parameter_count() const {
+  int64_t count = 0;
+  for (const Parameter& param : _parameters) {
+    count += (int64_t) param.value->rows() * param.value->cols();
+  }
+  return count;
+}
+
+
+const Matrix& Graph::layer_outputs(int layer) const {
+  assert(layer >= 0 && layer < layer_count());
+  if (layer == 0) return _buffers[0];
+  return _buffers[_steps[layer - 1].output];
+}
+
+
+const Node* Graph::layer_node(int layer) const {
+  assert(layer >= 0 && layer < layer_count());
+  if (layer == 0) return nullptr;
+  return _steps[layer - 1].node;
+}
+
+
+int Graph::layer_parameter(int layer) const {
+  assert(layer >= 0 && layer < layer_count());
+  if (layer == 0) return -1;
+  return _steps[layer - 1].first_parameter;
+}
+
+
+void write_matrix(std::ofstream& file, const Matrix& m) {
+  int rows = m.rows(), cols = m.cols();
+  assert(m.data().size() == (size_t) rows * cols);
+
+  file.write((const char*) &rows, sizeof rows);
+  file.write((const char*) &cols, sizeof cols);
+
+  for (matrix_t val : m.data()) {
+    file.write((const char*)&val, sizeof val);
+  }
+}
+
+
+Matrix read_matrix(std::ifstream& file) {
+  int rows, cols;
+  file.read((char*)&rows, sizeof rows);
+  file.read((char*)&cols, sizeof cols);
+  assert(rows >= 0 && cols >= 0);
+
+  Matrix m(rows, cols);
+  Matrix::data_t& data = m.data();
+  for (size_t i = 0; i < (size_t) rows * cols; i++) {
+    matrix_t val;
+    file.read((char*)&val, sizeof val);
+    data[i] = val;
+  }
+
+  return m;
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// F16C and AVX512-BF16 are used for the bulk conversions if the compiler
+// targets them (ex: -march=native), otherwise we fallback to the scalar
+// bit twiddling below. They give the same results, except float_to_bf16()
+// with AVX512-BF16 which flushes the denormal inputs to zero.
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+  #define HALF_F16C
+#endif
+
+#if defined(__AVX512BF16__) && defined(__AVX512F__)
+  #define HALF_AVX512_BF16
+#endif
+
+#if defined(HALF_F16C) || defined(HALF_AVX512_BF16) || defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
+
+// IEEE 754 half precision float (1 sign, 5 exponent, 10 mantissa bits).
+struct fp16_t {
+  uint16_t bits = 0;
+};
+
+
+// Brain float, the upper 16 bits of a float (1 sign, 8 exponent, 7 mantissa
+// bits). Same range as float with less precision.
+struct bf16_t {
+  uint16_t bits = 0;
+};
+
+
+float fp16_to_float(fp16_t value);
+fp16_t float_to_fp16(float value);
+
+float bf16_to_float(bf16_t value);
+bf16_t float_to_bf16(float value);
+
+// Bulk conversions, these are the ones used in the hot path.
+void fp16_to_float(const fp16_t* src, float* dst, size_t count);
+void float_to_fp16(const float* src, fp16_t* dst, size_t count);
+void bf16_to_float(const bf16_t* src, float* dst, size_t count);
+void float_to_bf16(const float* src, bf16_t* dst, size_t count);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <string.h>
+
+
+static inline uint32_t _float_bits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  return bits;
+}
+
+
+static inline float _bits_float(uint32_t bits) {
+  float value;
+  memcpy(&value, &bits, sizeof value);
+  return value;
+}
+
+
+float fp16_to_float(fp16_t value) {
+  uint32_t sign     = (uint32_t)(value.bits & 0x8000) << 16;
+  uint32_t exponent = (value.bits >> 10) & 0x1f;
+  uint32_t mantissa = value.bits & 0x3ff;
+
+  if (exponent == 0) {
+    if (mantissa == 0) return _bits_float(sign); // +/- zero.
+
+    // Subnormal, normalize it.
+    exponent = 127 - 15 + 1;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    mantissa &= 0x3ff;
+    return _bits_float(sign | (exponent << 23) | (mantissa << 13));
+  }
+
+  if (exponent == 0x1f) { // Inf or NaN.
+    return _bits_float(sign | 0x7f800000 | (mantissa << 13));
+  }
+
+  exponent = exponent - 15 + 127;
+  return _bits_float(sign | (exponent << 23) | (mantissa << 13));
+}
+
+
+fp16_t float_to_fp16(float value) {
+  uint32_t bits     = _float_bits(value);
+  uint16_t sign     = (uint16_t)((bits >> 16) & 0x8000);
+  int32_t  exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  fp16_t half;
+
+  if (((bits >> 23) & 0xff) == 0xff) { // Inf or NaN.
+    half.bits = sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    return half;
+  }
+
+  if (exponent >= 0x1f) { // Overflow to inf.
+    half.bits = sign | 0x7c00;
+    return half;
+  }
+
+  if (exponent <= 0) { // Subnormal or zero.
+    if (exponent < -10) {
+      half.bits = sign;
+      return half;
+    }
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t rounded = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (rounded & 1))) rounded++;
+    half.bits = sign | (uint16_t)rounded;
+    return half;
+  }
+
+  // Round to nearest even, a carry into the exponent is still correct.
+  uint32_t rounded = ((uint32_t)exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (rounded & 1))) rounded++;
+  half.bits = sign | (uint16_t)rounded;
+  return half;
+}
+
+
+float bf16_to_float(bf16_t value) {
+  return _bits_float((uint32_t)value.bits << 16);
+}
+
+
+bf16_t float_to_bf16(float value) {
+  uint32_t bits = _float_bits(value);
+  bf16_t half;
+  if ((bits & 0x7fffffff) > 0x7f800000) { // Keep NaN a (quiet) NaN.
+    half.bits = (uint16_t)((bits >> 16) | 0x40);
+    return half;
+  }
+  bits += 0x7fff + ((bits >> 16) & 1); // Round to nearest even.
+  half.bits = (uint16_t)(bits >> 16);
+  return half;
+}
+
+
+void fp16_to_float(const fp16_t* src, float* dst, size_t count) {
+  size_t i = 0;
+#ifdef HALF_F16C
+  for (; i + 8 <= count; i += 8) {
+    __m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+#endif
+  for (; i < count; i++) dst[i] = fp16_to_float(src[i]);
+}
+
+
+void float_to_fp16(const float* src, fp16_t* dst, size_t count) {
+  size_t i = 0;
+#ifdef HALF_F16C
+  for (; i + 8 <= count; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(dst + i), h);
+  }
+#endif
+  for (; i < count; i++) dst[i] = float_to_fp16(src[i]);
+}
+
+
+void bf16_to_float(const bf16_t* src, float* dst, size_t count) {
+  size_t i = 0;
+#ifdef __AVX2__
+  for (; i + 8 <= count; i += 8) {
+    __m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+    __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16);
+    _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(w));
+  }
+#endif
+  for (; i < count; i++) dst[i] = bf16_to_float(src[i]);
+}
+
+
+void float_to_bf16(const float* src, bf16_t* dst, size_t count) {
+  size_t i = 0;
+#ifdef HALF_AVX512_BF16
+  // Note that the instruction flushes denormal inputs to zero unlike the
+  // scalar path, which doesn't matter for weights.
+  for (; i + 16 <= count; i += 16) {
+    __m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), (__m256i)h);
+  }
+#endif
+  for (; i < count; i++) dst[i] = float_to_bf16(src[i]);
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -18,8 +18,24 @@
   } while (false)
 
 #define SINGLE_SOURCE_IMPL
+  #include "numa.hpp"
+  #include "trace.hpp"
+  #include "parallel.hpp"
+  #include "memory.hpp"
+  #include "random.hpp"
+  #include "blas.hpp"
+  #include "half.hpp"
   #include "matrix.hpp"
+  #include "activation.hpp"
+  #include "conv.hpp"
+  #include "profile.hpp"
+  #include "graph.hpp"
+  #include "nodes.hpp"
+  #include "optimizer.hpp"
+  #include "snapshot.hpp"
+  #include "schedule.hpp"
   #include "nn.hpp"
+  #include "metrics.hpp"
   #include "utils.hpp"
   #include "ui.hpp"
 #undef SINGLE_SOURCE_IMPL
@@ -30,10 +46,20 @@ float train(NN & nn, Dataset& dataset, int index) {
   
   float cost = 0.f;
   if (index < dataset.count()) {
-    Matrix expected = dataset.get_output(index);
+    Matrix expected, copy;
+    ConstMatrixView input;
+    {
+      TRACE_SCOPE("load", "data");
+      expected = dataset.get_output(index);
+      input = dataset.input_view(index);
+      if (input.data() == nullptr) {
+        copy = dataset.get_input(index);
+        input = copy;
+      }
+    }
 
-    nn.forward(dataset.get_input(index));
-    cost = error(nn.get_outputs(), expected);
+    nn.forward(input);
+    cost = nn.loss(nn.get_outputs(), expected);
     nn.backprop(expected);
   }
   return cost;
@@ -42,6 +68,20 @@ float train(NN & nn, Dataset& dataset, int index) {
 
 int main(void) {
 
+  // NN_TRACE=<path> records a timeline of the session, written at exit in
+  // the chrome trace format.
+  const char* trace_path = getenv("NN_TRACE");
+  trace_thread_name("main");
+  if (trace_path != nullptr) trace_start();
+
+  // NN_NUMA=1 spreads the datasets and the model over the numa nodes and
+  // pins the threads of the pool, for the multi socket machines.
+  const char* numa = getenv("NN_NUMA");
+  if (numa != nullptr && atoi(numa) != 0) {
+    set_numa_enabled(true);
+    set_parallel_affinity(true);
+  }
+
   DsMinist dset_train(
     "../dataset/train-labels.idx1-ubyte",
     "../dataset/train-images.idx3-ubyte");
@@ -50,7 +90,22 @@ int main(void) {
     "../dataset/t10k-labels.idx1-ubyte",
     "../dataset/t10k-images.idx3-ubyte");
 
-  NN nn({ 784, 20, 10, 10 }, { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" });
+  NN nn({ 784, 20, 10, 10 }, { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" },
+        { Activation::RELU, Activation::RELU, Activation::SOFTMAX }, WeightInit::HE);
+
+  // The last 10% of the training set is held out, the model is evaluated on
+  // it at the end of every epoch to adjust the learning rate and to stop once
+  // it doesn't improve anymore.
+  const int validation_count = dset_train.count() / 10;
+  const int train_count = dset_train.count() - validation_count;
+
+  LrScheduleParams schedule_params;
+  schedule_params.base_rate = nn.learn_rate;
+  schedule_params.warmup_steps = 1000;
+  schedule_params.gamma = 0.5f;
+  schedule_params.patience = 1;
+  LrSchedule schedule(LrScheduleType::PLATEAU, schedule_params);
+  EarlyStopping early_stopping(/*patience=*/3, /*min_delta=*/1e-4f, /*max_epochs=*/30);
 
   UI ui(&nn, &dset_train, &dset_test);
 
@@ -58,27 +113,48 @@ int main(void) {
   ui.set_texture(&tex);
 
   while (!WindowShouldClose()) {
+    TRACE_SCOPE("frame", "ui");
     ui.handle_inputs();
 
     switch (ui.get_state()) {
       case UI::TRAINING:
       {
-        if (nn.data_index == dset_train.count()) {
+        if (nn.data_index >= train_count) {
           nn.trained++;
-          if (nn.trained >= 3) { // TODO: parameterize number 3.
+          nn.data_index = 0;
+
+          PROFILE_ONLY(
+            MemoryStats memory = memory_stats();
+            printf("epoch %i: %.1f matrix allocations per sample, peak %.2f MiB\n", nn.trained,
+                   (double) memory.allocations / train_count, memory.peak_bytes / (1024. * 1024.));
+            nn.graph.profile().print();
+            memory_print_sites();
+            nn.graph.profile().reset();
+            memory_reset_stats();
+          )
+
+          float validation_error = nn.evaluate(dset_train, train_count, validation_count);
+          schedule.epoch_end(validation_error);
+          early_stopping.epoch_end(validation_error);
+          if (early_stopping.should_stop()) {
             ui.set_state(UI::IDLE);
             // TODO: ui.training = false;
-            ui.message("Model trained!");
+            ui.message(TextFormat("Model trained! (validation error %.4f at epoch %i)",
+                                  early_stopping.best(), early_stopping.best_epoch()));
             break;
           }
-          nn.data_index = 0;
         }
 
-        Image img = dset_train.images[nn.data_index];
-        if (IsTextureReady(tex)) UnloadTexture(tex);
+        nn.learn_rate = schedule.rate(nn.optimizer.steps, nn.trained);
 
-        tex = LoadTextureFromImage(img);
-        ui.set_texture(&tex);
+        {
+          TRACE_SCOPE("texture", "ui");
+          Image img = dset_train.images[nn.data_index];
+          if (IsTextureReady(tex)) UnloadTexture(tex);
+
+          tex = LoadTextureFromImage(img);
+          ui.set_texture(&tex);
+        }
 
         float cost = train(nn, dset_train, nn.data_index);
         ui.push_error(cost);
@@ -89,30 +165,24 @@ int main(void) {
 
       case UI::TESTING:
       {
-        static int data_index = 0;
-
-        if (data_index == dset_test.count()) {
-          ui.set_state(UI::IDLE);
-          ui.message("Model trained!");
-          data_index = 0;
-          break;
-        }
-
-        Image img = dset_test.images[data_index];
-        if (IsTextureReady(tex)) UnloadTexture(tex);
-
-        tex = LoadTextureFromImage(img);
-        ui.set_texture(&tex);
-
-        Matrix expected = dset_test.get_output(data_index);
-        nn.forward(dset_test.get_input(data_index));
-        data_index++;
+        // The whole test set is classified at once, in parallel batches.
+        double start = GetTime();
+        ClassificationReport report = evaluate_classification(nn, dset_test, 0, dset_test.count());
+        double seconds = GetTime() - start;
+
+        report.print();
+        ui.set_state(UI::IDLE);
+        ui.message(TextFormat("Test accuracy %.2f%% (%i samples in %.0f ms)",
+                              report.accuracy() * 100, report.count, seconds * 1000));
         break;
       }
     }
 
+    // The ui draws the last published version of the model.
+    nn.publish();
     ui.update();
 
+    TRACE_SCOPE("render", "ui");
     BeginDrawing();
     {
       ClearBackground(RAYWHITE);
@@ -122,6 +192,11 @@ int main(void) {
     EndDrawing();
   }
 
+  if (trace_path != nullptr) {
+    trace_stop();
+    if (trace_write(trace_path)) printf("Trace written to %s\n", trace_path);
+  }
+
   if (IsTextureReady(tex)) UnloadTexture(tex);
 
   ui.cleanup();
@@ -1,156 +1,985 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
+#include <array>
+#include <type_traits>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "half.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "random.hpp"
+#include "blas.hpp"
+
 typedef float matrix_t;
 
 
-class Matrix {
+// Element type traits of a matrix. The values are loaded into accum_t, all
+// the arithmetic is done in it and the results are stored back as T. This
+// lets the reduced precision and integer matrices share the same kernels.
+template <typename T>
+struct MatrixTraits {
+  typedef T accum_t;
+  static inline accum_t load(T value) { return value; }
+  static inline T store(accum_t value) { return value; }
+};
+
+
+template <>
+struct MatrixTraits<fp16_t> {
+  typedef float accum_t;
+  static inline accum_t load(fp16_t value) { return fp16_to_float(value); }
+  static inline fp16_t store(accum_t value) { return float_to_fp16(value); }
+};
+
+
+template <>
+struct MatrixTraits<bf16_t> {
+  typedef float accum_t;
+  static inline accum_t load(bf16_t value) { return bf16_to_float(value); }
+  static inline bf16_t store(accum_t value) { return float_to_bf16(value); }
+};
+
+
+template <>
+struct MatrixTraits<int8_t> {
+  typedef int32_t accum_t;
+  static inline accum_t load(int8_t value) { return value; }
+  static inline int8_t store(accum_t value) {
+    return (int8_t)((value < -128) ? -128 : (value > 127) ? 127 : value);
+  }
+};
+
+
+// Storage of the matrix. If both R and C are non zero the dimensions are
+// compile time constants and the data is an inline array, which let the
+// compiler fully unroll the loops of small matrices and keep them in
+// registers. Otherwise the matrix is sized at runtime.
+template <typename T, int R, int C>
+class MatrixStorage {
+  static_assert(R > 0 && C > 0, "Both dimensions should be either fixed or dynamic.");
+
 public:
-  Matrix(int rows=0, int cols=0, matrix_t val=0);
+  typedef std::array<T, R * C> data_t;
 
-  Matrix& init(int rows, int cols, matrix_t val = 0);
-  Matrix& fill(matrix_t val);
+  constexpr int rows() const { return R; }
+  constexpr int cols() const { return C; }
 
-  void print() const;
+protected:
+  void _resize(int rows, int cols, T val) {
+    assert(rows == R && cols == C);
+    _data.fill(val);
+  }
 
-  // Inplace operations.
-  Matrix& operator+=(const Matrix& other);
-  Matrix& operator*=(matrix_t value); // Dot product.
-  Matrix& multiply_inplace(const Matrix& other); // Element by element.
+  data_t _data;
+};
 
-  // Operators that'll return new matrix.
-  Matrix operator-(const Matrix& other) const;
-  Matrix operator*(const Matrix& other) const;
-  Matrix operator*(matrix_t value) const;
-  Matrix transpose() const;
-  Matrix multiply(const Matrix& other) const;
 
-  matrix_t at(int row, int col) const;
-  void set(int row, int col, matrix_t value);
+// The runtime sized data is 64 byte aligned and re-initializing a matrix
+// with the same or smaller size reuse the buffer.
+template <typename T>
+class MatrixStorage<T, 0, 0> {
+public:
+  typedef AlignedBuffer<T> data_t;
 
-  matrix_t sum() const;
-  Matrix& randomize(matrix_t min = 0, matrix_t max = 1);
-  Matrix& sigmoid();
-  Matrix& square();
+  int rows() const { return _rows; }
+  int cols() const { return _cols; }
 
-  std::vector<matrix_t>& data();
-  const std::vector<matrix_t>& data() const;
+protected:
+  void _resize(int rows, int cols, T val) {
+    _rows = rows;
+    _cols = cols;
+    _data.assign((size_t)rows * cols, val);
+  }
 
-  int rows() const;
-  int cols() const;
+  int _rows = 0, _cols = 0;
+  data_t _data;
+};
+
+
+template <typename T, int R = 0, int C = 0>
+class MatrixT;
+
+
+// ---------------------------------------------------------------------------
+// Expressions
+// ---------------------------------------------------------------------------
+
+// Element wise operations are lazy, (a - b).square() doesn't compute anything
+// it builds an expression which is evaluated in a single loop when it's
+// assigned to a matrix (or reduced with sum()), without any temporaries.
+//
+// Matrices in an expression are referenced not copied, so an expression
+// shouldn't outlive the matrices it's built from, ie. don't store one with
+// auto if it references a temporary like the result of a transpose().
+//
+// Every expression E has accum_t, rows(), cols() and eval(index) which
+// returns the value at the flat (row major) index.
+template <typename E>
+class MatrixExpr {
+public:
+  const E& self() const { return static_cast<const E&>(*this); }
+
+  auto square() const;
+  auto sigmoid() const;
+
+  template <typename E2>
+  auto multiply(const MatrixExpr<E2>& other) const; // Element by element.
+
+  // Pairwise sum (see reduce_sum()), the result doesn't depend on the
+  // number of threads.
+  auto sum() const;
+
+  // Kahan compensated sum, sequential and slower but the error doesn't grow
+  // with the size.
+  auto sum_compensated() const;
+};
+
+
+// Matrices are stored as references in an expression and sub expressions
+// are stored by value.
+template <typename E>
+struct MatrixExprRef {
+  typedef E type;
+};
+
+
+template <typename T, int R, int C>
+struct MatrixExprRef<MatrixT<T, R, C>> {
+  typedef const MatrixT<T, R, C>& type;
+};
+
+
+template <typename Op, typename L, typename Rhs>
+class MatrixBinaryExpr : public MatrixExpr<MatrixBinaryExpr<Op, L, Rhs>> {
+public:
+  typedef typename L::accum_t accum_t;
+  static_assert(std::is_same<accum_t, typename Rhs::accum_t>::value,
+                "Both side of an expression should have the same element type.");
+
+  MatrixBinaryExpr(const L& lhs, const Rhs& rhs) : _lhs(lhs), _rhs(rhs) {
+    assert(lhs.rows() == rhs.rows() && lhs.cols() == rhs.cols());
+  }
+
+  int rows() const { return _lhs.rows(); }
+  int cols() const { return _lhs.cols(); }
+  accum_t eval(size_t index) const { return Op()(_lhs.eval(index), _rhs.eval(index)); }
 
 private:
-  int _rows, _cols;
-  std::vector<matrix_t> _data;
+  typename MatrixExprRef<L>::type _lhs;
+  typename MatrixExprRef<Rhs>::type _rhs;
 };
 
 
-#ifdef SINGLE_SOURCE_IMPL
+template <typename Op, typename E>
+class MatrixUnaryExpr : public MatrixExpr<MatrixUnaryExpr<Op, E>> {
+public:
+  typedef typename E::accum_t accum_t;
 
-#include <stdlib.h>
-#include <math.h>
+  MatrixUnaryExpr(const E& expr, Op op = Op()) : _expr(expr), _op(op) {}
 
+  int rows() const { return _expr.rows(); }
+  int cols() const { return _expr.cols(); }
+  accum_t eval(size_t index) const { return _op(_expr.eval(index)); }
 
-Matrix::Matrix(int rows, int cols, matrix_t val)
-  : _rows(rows), _cols(cols), _data(rows* cols, val)
-{}
+private:
+  typename MatrixExprRef<E>::type _expr;
+  Op _op;
+};
 
 
-Matrix& Matrix::init(int rows, int cols, matrix_t val) {
-  this->_rows = rows;
-  this->_cols = cols;
-  this->_data = std::vector<matrix_t>(rows * cols, val);
-  return *this;
+template <typename T>
+static inline T sigmoid(T x) {
+  return (T)1 / ((T)1 + (T)exp(-x));
 }
 
 
-matrix_t Matrix::at(int row, int col) const {
-  return _data[row * _cols + col];
+static inline float sigmoid(float x) {
+  return 1.f / (1.f + expf(-x));
 }
 
 
-void Matrix::set(int row, int col, matrix_t value) {
-  _data[row * _cols + col] = value;
+struct OpAdd {
+  template <typename A> A operator()(A a, A b) const { return a + b; }
+};
+
+
+struct OpSub {
+  template <typename A> A operator()(A a, A b) const { return a - b; }
+};
+
+
+struct OpMul {
+  template <typename A> A operator()(A a, A b) const { return a * b; }
+};
+
+
+struct OpSquare {
+  template <typename A> A operator()(A a) const { return a * a; }
+};
+
+
+struct OpSigmoid {
+  template <typename A> A operator()(A a) const { return ::sigmoid(a); }
+};
+
+
+template <typename A>
+struct OpScale {
+  A value;
+  A operator()(A a) const { return a * value; }
+};
+
+
+template <typename A>
+struct OpSubFrom { // value - a
+  A value;
+  A operator()(A a) const { return value - a; }
+};
+
+
+template <typename E>
+auto MatrixExpr<E>::square() const {
+  return MatrixUnaryExpr<OpSquare, E>(self());
 }
 
 
-Matrix& Matrix::fill(matrix_t val) {
-  for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] = val;
+template <typename E>
+auto MatrixExpr<E>::sigmoid() const {
+  return MatrixUnaryExpr<OpSigmoid, E>(self());
+}
+
+
+template <typename E>
+template <typename E2>
+auto MatrixExpr<E>::multiply(const MatrixExpr<E2>& other) const {
+  return MatrixBinaryExpr<OpMul, E, E2>(self(), other.self());
+}
+
+
+template <typename L, typename Rhs>
+auto operator+(const MatrixExpr<L>& lhs, const MatrixExpr<Rhs>& rhs) {
+  return MatrixBinaryExpr<OpAdd, L, Rhs>(lhs.self(), rhs.self());
+}
+
+
+template <typename L, typename Rhs>
+auto operator-(const MatrixExpr<L>& lhs, const MatrixExpr<Rhs>& rhs) {
+  return MatrixBinaryExpr<OpSub, L, Rhs>(lhs.self(), rhs.self());
+}
+
+
+template <typename E>
+auto operator-(typename E::accum_t value, const MatrixExpr<E>& expr) {
+  typedef OpSubFrom<typename E::accum_t> Op;
+  return MatrixUnaryExpr<Op, E>(expr.self(), Op{ value });
+}
+
+
+template <typename E>
+auto operator*(const MatrixExpr<E>& expr, typename E::accum_t value) {
+  typedef OpScale<typename E::accum_t> Op;
+  return MatrixUnaryExpr<Op, E>(expr.self(), Op{ value });
+}
+
+
+// ---------------------------------------------------------------------------
+// Views
+// ---------------------------------------------------------------------------
+
+// Non owning reference to a (rows x cols) block of row major data where
+// consecutive rows are ld (leading dimension) elements apart. A view of a
+// whole matrix has ld == cols, a row of a batch or a block of columns has
+// ld > cols. T is const for read only views.
+//
+// Views are expressions and the kernels (gemm, transpose) take views so any
+// part of a matrix or an external buffer can be used without a copy. Copying
+// a view copies the reference not the data, use assign() for that.
+template <typename T>
+class MatrixViewT : public MatrixExpr<MatrixViewT<T>> {
+public:
+  typedef typename std::remove_const<T>::type value_type;
+  typedef typename MatrixTraits<value_type>::accum_t accum_t;
+
+  MatrixViewT() = default;
+  MatrixViewT(T* data, int rows, int cols, int ld = -1)
+    : _data(data), _rows(rows), _cols(cols), _ld((ld < 0) ? cols : ld) {
+    assert(_ld >= _cols);
+  }
+
+  // Views of the entire matrix, the const view can be made from both.
+  template <int R, int C>
+  MatrixViewT(MatrixT<value_type, R, C>& m);
+  template <int R, int C>
+  MatrixViewT(const MatrixT<value_type, R, C>& m);
+
+  // A read only view can be made from a mutable one.
+  template <typename U, typename = typename std::enable_if<std::is_same<const U, T>::value>::type>
+  MatrixViewT(const MatrixViewT<U>& other)
+    : _data(other.data()), _rows(other.rows()), _cols(other.cols()), _ld(other.ld()) {}
+
+  int rows() const { return _rows; }
+  int cols() const { return _cols; }
+  int ld() const { return _ld; }
+  bool contiguous() const { return _ld == _cols; }
+  T* data() const { return _data; }
+  T* row_data(int row) const { return _data + (size_t)row * _ld; }
+
+  accum_t at(int row, int col) const { return traits::load(_data[(size_t)row * _ld + col]); }
+  void set(int row, int col, accum_t value) const { _data[(size_t)row * _ld + col] = traits::store(value); }
+
+  accum_t eval(size_t index) const {
+    if (contiguous()) return traits::load(_data[index]);
+    return at((int)(index / _cols), (int)(index % _cols));
+  }
+
+  MatrixViewT row(int row) const { return block(row, 0, 1, _cols); }
+  MatrixViewT rows(int row, int count) const { return block(row, 0, count, _cols); }
+  MatrixViewT col(int col) const { return block(0, col, _rows, 1); }
+  MatrixViewT block(int row, int col, int rows, int cols) const {
+    assert(row >= 0 && col >= 0 && row + rows <= _rows && col + cols <= _cols);
+    return MatrixViewT(_data + (size_t)row * _ld + col, rows, cols, _ld);
+  }
+
+  // Element wise writes through the view.
+  template <typename E>
+  const MatrixViewT& assign(const MatrixExpr<E>& expr) const;
+  template <typename E>
+  const MatrixViewT& operator+=(const MatrixExpr<E>& expr) const;
+  const MatrixViewT& fill(accum_t value) const;
+
+private:
+  typedef MatrixTraits<value_type> traits;
+
+  T* _data = nullptr;
+  int _rows = 0, _cols = 0, _ld = 0;
+};
+
+
+typedef MatrixViewT<matrix_t> MatrixView;
+typedef MatrixViewT<const matrix_t> ConstMatrixView;
+
+
+template <typename T>
+template <typename E>
+const MatrixViewT<T>& MatrixViewT<T>::assign(const MatrixExpr<E>& expr) const {
+  const E& e = expr.self();
+  assert(e.rows() == _rows && e.cols() == _cols);
+  size_t index = 0;
+  for (int r = 0; r < _rows; r++) {
+    T* row = row_data(r);
+    for (int c = 0; c < _cols; c++) row[c] = traits::store(e.eval(index++));
   }
   return *this;
 }
 
 
-Matrix& Matrix::randomize(matrix_t min, matrix_t max) {
+template <typename T>
+template <typename E>
+const MatrixViewT<T>& MatrixViewT<T>::operator+=(const MatrixExpr<E>& expr) const {
+  const E& e = expr.self();
+  assert(e.rows() == _rows && e.cols() == _cols);
+  size_t index = 0;
+  for (int r = 0; r < _rows; r++) {
+    T* row = row_data(r);
+    for (int c = 0; c < _cols; c++) {
+      row[c] = traits::store(traits::load(row[c]) + e.eval(index++));
+    }
+  }
+  return *this;
+}
+
 
-  assert(max > min);
-  for (size_t i = 0; i < _data.size(); i++) {
-    matrix_t val = (matrix_t)((float)rand() / (float)RAND_MAX) * (max - min) + min;
-    _data[i] = val;
+template <typename T>
+const MatrixViewT<T>& MatrixViewT<T>::fill(accum_t value) const {
+  value_type stored = traits::store(value);
+  for (int r = 0; r < _rows; r++) {
+    T* row = row_data(r);
+    for (int c = 0; c < _cols; c++) row[c] = stored;
   }
   return *this;
 }
 
 
-matrix_t Matrix::sum() const {
-  matrix_t total = 0;
-  for (size_t i = 0; i < _data.size(); i++) {
-    total += _data[i];
+// ---------------------------------------------------------------------------
+// Kernels
+// ---------------------------------------------------------------------------
+
+// The element wise assignments of at least ELEMENTWISE_PARALLEL_MIN values
+// are split into chunks between the threads.
+#define ELEMENTWISE_PARALLEL_MIN (1 << 16)
+#define ELEMENTWISE_CHUNK_SIZE (1 << 14)
+
+
+// The builtin gemm runs on the thread pool when m * n * k is at least
+// GEMM_PARALLEL_MIN_WORK, the output is split into tiles of
+// GEMM_TILE_ROWS x GEMM_TILE_COLS. Every output is computed the same way by
+// a single task, so the result doesn't depend on the threads.
+#define GEMM_PARALLEL_MIN_WORK (1 << 18)
+#define GEMM_TILE_ROWS 8
+#define GEMM_TILE_COLS 256
+
+
+// The rows [r0, r1) and columns [c0, c1) of the gemm below.
+template <typename T>
+void _gemm_tile(MatrixViewT<const T> a, MatrixViewT<const T> b, MatrixViewT<T> c,
+                typename MatrixTraits<T>::accum_t alpha, typename MatrixTraits<T>::accum_t beta,
+                bool trans_a, bool trans_b, int r0, int r1, int c0, int c1) {
+  typedef MatrixTraits<T> traits;
+  typedef typename traits::accum_t accum_t;
+
+  const int k = (trans_a) ? a.rows() : a.cols();
+  const int n = c1 - c0;
+
+  // The row of op(a) (scaled by alpha) is gathered first since it's strided
+  // if a is transposed, and reduced precision types are accumulated in an
+  // accum_t row and stored once. The rows are scratch of the thread, kept
+  // between the calls so the tiles don't allocate.
+  const bool direct = std::is_same<T, accum_t>::value;
+  static thread_local AlignedBuffer<accum_t> a_row;
+  static thread_local AlignedBuffer<accum_t> acc_row;
+  a_row.resize(k);
+  if (!direct) acc_row.resize(n);
+
+  for (int r = r0; r < r1; r++) {
+    T* out = c.row_data(r) + c0;
+    accum_t* acc = (direct) ? (accum_t*)out : acc_row.data();
+    for (int j = 0; j < n; j++) {
+      acc[j] = (beta == 0) ? 0 : beta * traits::load(out[j]);
+    }
+
+    for (int i = 0; i < k; i++) {
+      a_row[i] = alpha * ((trans_a) ? a.at(i, r) : a.at(r, i));
+    }
+
+    if (!trans_b) {
+      // Accumulate rows of b scaled by op(a)(r, i), so the inner loop walks
+      // both b and the output contiguously.
+      for (int i = 0; i < k; i++) {
+        accum_t scale = a_row[i];
+        const T* row = b.row_data(i) + c0;
+        for (int j = 0; j < n; j++) {
+          acc[j] += scale * traits::load(row[j]);
+        }
+      }
+
+    } else {
+      // Columns of op(b) are rows of b, so each output is a dot product.
+      for (int j = 0; j < n; j++) {
+        const T* row = b.row_data(c0 + j);
+        accum_t dot = 0;
+        for (int i = 0; i < k; i++) {
+          dot += a_row[i] * traits::load(row[i]);
+        }
+        acc[j] += dot;
+      }
+    }
+
+    if (!direct) {
+      for (int j = 0; j < n; j++) out[j] = traits::store(acc[j]);
+    }
+  }
+}
+
+
+// c = alpha * (op(a) * op(b)) + beta * c, where op(x) is x.transpose() if
+// the trans flag of it is set. Float and double are offered to the blas
+// backend first (see blas.hpp).
+template <typename T>
+void gemm(MatrixViewT<const T> a, MatrixViewT<const T> b, MatrixViewT<T> c,
+          typename MatrixTraits<T>::accum_t alpha = 1,
+          typename MatrixTraits<T>::accum_t beta = 0,
+          bool trans_a = false, bool trans_b = false) {
+
+  const int m = c.rows();
+  const int n = c.cols();
+  const int k = (trans_a) ? a.rows() : a.cols(); // Width or a row.
+
+  // (r1 x c1) * (r2 x c2) =>
+  //   assert(c1 == r2), result = (r1 x c2)
+  assert(m == ((trans_a) ? a.cols() : a.rows()));
+  assert(n == ((trans_b) ? b.rows() : b.cols()));
+  assert(k == ((trans_b) ? b.cols() : b.rows()));
+
+  if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value) {
+    if (blas_gemm(trans_a, trans_b, m, n, k, alpha, a.data(), a.ld(),
+                  b.data(), b.ld(), beta, c.data(), c.ld())) {
+      return;
+    }
+  }
+
+  const int row_tiles = (m + GEMM_TILE_ROWS - 1) / GEMM_TILE_ROWS;
+  const int col_tiles = (n + GEMM_TILE_COLS - 1) / GEMM_TILE_COLS;
+  if ((int64_t) m * n * k < GEMM_PARALLEL_MIN_WORK || row_tiles * col_tiles == 1) {
+    _gemm_tile(a, b, c, alpha, beta, trans_a, trans_b, 0, m, 0, n);
+    return;
+  }
+
+  parallel_for(row_tiles * col_tiles, [&](int tile) {
+    int r0 = (tile / col_tiles) * GEMM_TILE_ROWS;
+    int c0 = (tile % col_tiles) * GEMM_TILE_COLS;
+    _gemm_tile(a, b, c, alpha, beta, trans_a, trans_b,
+               r0, std::min(r0 + GEMM_TILE_ROWS, m), c0, std::min(c0 + GEMM_TILE_COLS, n));
+  });
+}
+
+
+// y += alpha * x
+template <typename T>
+void axpy(typename MatrixTraits<T>::accum_t alpha, MatrixViewT<const T> x, MatrixViewT<T> y) {
+  typedef MatrixTraits<T> traits;
+  assert(x.rows() == y.rows() && x.cols() == y.cols());
+
+  if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value) {
+    if (x.contiguous() && y.contiguous() &&
+        blas_axpy(x.rows() * x.cols(), alpha, x.data(), y.data())) {
+      return;
+    }
+  }
+
+  for (int r = 0; r < y.rows(); r++) {
+    const T* src = x.row_data(r);
+    T* dst = y.row_data(r);
+    for (int c = 0; c < y.cols(); c++) {
+      dst[c] = traits::store(traits::load(dst[c]) + alpha * traits::load(src[c]));
+    }
+  }
+}
+
+
+// Blocks up to this size are summed with multiple accumulators, and the
+// reductions are split into chunks of this many blocks between threads.
+#define REDUCE_BLOCK_SIZE 256
+#define REDUCE_CHUNK_SIZE (REDUCE_BLOCK_SIZE * 512)
+
+
+// Pairwise sum of get(i) for i in [begin, end). Small blocks are summed into
+// 8 independent accumulators which breaks the add dependency chain (and the
+// compiler can vectorize), then the blocks are combined as a binary tree so
+// the rounding error grows with O(log n) instead of O(n).
+template <typename A, typename F>
+A pairwise_sum(const F& get, size_t begin, size_t end) {
+  size_t count = end - begin;
+
+  if (count <= REDUCE_BLOCK_SIZE) {
+    A acc[8] = { 0 };
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+      for (int k = 0; k < 8; k++) acc[k] += get(i + k);
+    }
+    for (int k = 0; i < end; i++, k++) acc[k] += get(i);
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) +
+           ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+  }
+
+  size_t half = begin + ((count / 2) & ~(size_t)7);
+  return pairwise_sum<A>(get, begin, half) + pairwise_sum<A>(get, half, end);
+}
+
+
+// Sum of get(i) for i in [0, count). Large reductions are split into fixed
+// size chunks which are summed in parallel, and the chunk sums are combined
+// pairwise. Since the chunks don't depend on the thread count the result is
+// the same for any number of threads.
+template <typename A, typename F>
+A reduce_sum(const F& get, size_t count) {
+  if (count <= REDUCE_CHUNK_SIZE) return pairwise_sum<A>(get, 0, count);
+
+  int chunks = (int)((count + REDUCE_CHUNK_SIZE - 1) / REDUCE_CHUNK_SIZE);
+  std::vector<A> sums(chunks);
+  parallel_for(chunks, [&](int chunk) {
+    size_t begin = (size_t)chunk * REDUCE_CHUNK_SIZE;
+    size_t end = (begin + REDUCE_CHUNK_SIZE < count) ? begin + REDUCE_CHUNK_SIZE : count;
+    sums[chunk] = pairwise_sum<A>(get, begin, end);
+  });
+
+  auto get_sum = [&](size_t i) { return sums[i]; };
+  return pairwise_sum<A>(get_sum, 0, sums.size());
+}
+
+
+// Sequential Kahan summation of get(i) for i in [0, count), the lost low
+// order bits of each add are carried into the next one.
+template <typename A, typename F>
+A compensated_sum(const F& get, size_t count) {
+  A total = 0, compensation = 0;
+  for (size_t i = 0; i < count; i++) {
+    A value = get(i) - compensation;
+    A t = total + value;
+    compensation = (t - total) - value;
+    total = t;
   }
   return total;
 }
 
 
-static inline matrix_t sigmoid(matrix_t x) {
-  return 1.f / (1.f + expf(-x));
+template <typename E>
+auto MatrixExpr<E>::sum() const {
+  const E& e = self();
+  auto get = [&e](size_t i) { return e.eval(i); };
+  return reduce_sum<typename E::accum_t>(get, (size_t)e.rows() * e.cols());
 }
 
 
-Matrix& Matrix::sigmoid() {
-  for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] = ::sigmoid(_data[i]);
+template <typename E>
+auto MatrixExpr<E>::sum_compensated() const {
+  const E& e = self();
+  auto get = [&e](size_t i) { return e.eval(i); };
+  return compensated_sum<typename E::accum_t>(get, (size_t)e.rows() * e.cols());
+}
+
+
+// dst = src.transpose()
+template <typename T>
+void transpose(MatrixViewT<const T> src, MatrixViewT<T> dst) {
+  assert(src.rows() == dst.cols() && src.cols() == dst.rows());
+  for (int r = 0; r < src.rows(); r++) {
+    const T* row = src.row_data(r);
+    for (int c = 0; c < src.cols(); c++) {
+      dst.row_data(c)[r] = row[c];
+    }
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+// Matrix
+// ---------------------------------------------------------------------------
+
+template <typename T, int R, int C>
+class MatrixT : public MatrixStorage<T, R, C>, public MatrixExpr<MatrixT<T, R, C>> {
+public:
+  typedef T value_type;
+  typedef typename MatrixTraits<T>::accum_t accum_t;
+  typedef typename MatrixStorage<T, R, C>::data_t data_t;
+
+  MatrixT(int rows = R, int cols = C, accum_t val = 0);
+
+  // Evaluate an expression into a new matrix.
+  template <typename E>
+  MatrixT(const MatrixExpr<E>& expr);
+
+  template <typename E>
+  MatrixT& operator=(const MatrixExpr<E>& expr);
+
+  MatrixT& init(int rows, int cols, accum_t val = 0);
+  MatrixT& fill(accum_t val);
+
+  void print() const;
+
+  // Inplace operations.
+  template <typename E>
+  MatrixT& operator+=(const MatrixExpr<E>& other);
+  MatrixT& operator*=(accum_t value); // Dot product.
+  template <typename E>
+  MatrixT& multiply_inplace(const MatrixExpr<E>& other); // Element by element.
+
+  // Operators that'll return new matrix, the element wise ones (-, * value,
+  // multiply) are expressions defined above.
+  MatrixT<T, C, R> transpose() const;
+
+  // (R x C) * (C x K) => (R x K), K is 0 for runtime sized matrices.
+  template <int K>
+  MatrixT<T, R, K> operator*(const MatrixT<T, C, K>& other) const;
+
+  accum_t at(int row, int col) const;
+  void set(int row, int col, accum_t value);
+  accum_t eval(size_t index) const { return _load(index); }
+
+  MatrixViewT<T> view() { return *this; }
+  MatrixViewT<const T> view() const { return *this; }
+  MatrixViewT<T> row(int row) { return view().row(row); }
+  MatrixViewT<const T> row(int row) const { return view().row(row); }
+  MatrixViewT<T> col(int col) { return view().col(col); }
+  MatrixViewT<const T> col(int col) const { return view().col(col); }
+  MatrixViewT<T> block(int row, int col, int rows, int cols) { return view().block(row, col, rows, cols); }
+  MatrixViewT<const T> block(int row, int col, int rows, int cols) const { return view().block(row, col, rows, cols); }
+
+  // Fill with random values of the rng stream, the value at each index only
+  // depends on the stream, not on the number of threads filling it. Without
+  // an rng the next global stream is used (see Rng::next()).
+  MatrixT& randomize(accum_t min = 0, accum_t max = 1);
+  MatrixT& randomize(const Rng& rng, accum_t min = 0, accum_t max = 1);
+  MatrixT& randomize_normal(const Rng& rng, accum_t mean = 0, accum_t stddev = 1);
+  MatrixT& sigmoid();
+  MatrixT& square();
+
+  data_t& data();
+  const data_t& data() const;
+
+  using MatrixStorage<T, R, C>::rows;
+  using MatrixStorage<T, R, C>::cols;
+
+private:
+  using MatrixStorage<T, R, C>::_data;
+  typedef MatrixTraits<T> traits;
+
+  template <typename E>
+  void _assign(const E& expr);
+
+  // Calls fn(bits, values) for each block of 4 random values of the rng to
+  // convert them, and store the values.
+  template <typename F>
+  void _fill_random(const Rng& rng, F fn);
+
+  accum_t _load(size_t index) const { return traits::load(_data[index]); }
+  void _store(size_t index, accum_t value) { _data[index] = traits::store(value); }
+};
+
+
+// The runtime sized matrix that the rest of the project uses.
+typedef MatrixT<matrix_t> Matrix;
+
+
+// Storage precision of a packed matrix.
+enum class Precision {
+  FP32,
+  FP16,
+  BF16,
+};
+
+
+// Read only copy of a matrix stored in reduced precision (fp16 / bf16) to
+// halve the memory and bandwidth. The values are widened back to matrix_t
+// when they're loaded, all the accumulations are done in matrix_t.
+class PackedMatrix {
+public:
+  PackedMatrix();
+
+  PackedMatrix& pack(const Matrix& m, Precision precision);
+  Matrix unpack() const;
+
+  // Widen a single row into dst, which should have space for cols() values.
+  void unpack_row(int row, matrix_t* dst) const;
+  matrix_t at(int row, int col) const;
+
+  void clear();
+  bool empty() const;
+
+  int rows() const;
+  int cols() const;
+  Precision precision() const;
+
+private:
+  int _rows, _cols;
+  Precision _precision;
+  AlignedBuffer<uint16_t> _data;
+};
+
+
+// c = a * b where b is packed.
+void gemm_packed(ConstMatrixView a, const PackedMatrix& b, MatrixView c);
+
+// (r1 x c1) * (r2 x c2) where the rhs is packed.
+Matrix operator*(const Matrix& m, const PackedMatrix& packed);
+
+
+// ---------------------------------------------------------------------------
+// MatrixT implementation, templates have to live in the header.
+// ---------------------------------------------------------------------------
+
+template <typename T>
+template <int R, int C>
+MatrixViewT<T>::MatrixViewT(MatrixT<value_type, R, C>& m)
+  : MatrixViewT(m.data().data(), m.rows(), m.cols()) {}
+
+
+template <typename T>
+template <int R, int C>
+MatrixViewT<T>::MatrixViewT(const MatrixT<value_type, R, C>& m)
+  : MatrixViewT(m.data().data(), m.rows(), m.cols()) {}
+
+
+template <typename T, int R, int C>
+MatrixT<T, R, C>::MatrixT(int rows, int cols, accum_t val) {
+  this->_resize(rows, cols, traits::store(val));
+}
+
+
+template <typename T, int R, int C>
+template <typename E>
+MatrixT<T, R, C>::MatrixT(const MatrixExpr<E>& expr) {
+  const E& e = expr.self();
+  this->_resize(e.rows(), e.cols(), T());
+  _assign(e);
+}
+
+
+template <typename T, int R, int C>
+template <typename E>
+MatrixT<T, R, C>& MatrixT<T, R, C>::operator=(const MatrixExpr<E>& expr) {
+  const E& e = expr.self();
+
+  // Element wise expressions only read the same index they write so it's
+  // safe to evaluate in place even if the expression reference this matrix,
+  // but not after a resize.
+  if (rows() != e.rows() || cols() != e.cols()) {
+    *this = MatrixT(expr);
+    return *this;
   }
+
+  _assign(e);
   return *this;
 }
 
 
-Matrix& Matrix::square() {
+template <typename T, int R, int C>
+template <typename E>
+void MatrixT<T, R, C>::_assign(const E& expr) {
+  static_assert(std::is_same<accum_t, typename E::accum_t>::value,
+                "Cannot assign an expression of different element type.");
+  parallel_chunks(_data.size(), ELEMENTWISE_CHUNK_SIZE, ELEMENTWISE_PARALLEL_MIN, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) _store(i, expr.eval(i));
+  });
+}
+
+
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::init(int rows, int cols, accum_t val) {
+  this->_resize(rows, cols, traits::store(val));
+  return *this;
+}
+
+
+template <typename T, int R, int C>
+typename MatrixT<T, R, C>::accum_t MatrixT<T, R, C>::at(int row, int col) const {
+  return _load(row * cols() + col);
+}
+
+
+template <typename T, int R, int C>
+void MatrixT<T, R, C>::set(int row, int col, accum_t value) {
+  _store(row * cols() + col, value);
+}
+
+
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::fill(accum_t val) {
+  T stored = traits::store(val);
   for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] = _data[i] * _data[i];
+    _data[i] = stored;
   }
   return *this;
 }
 
 
-std::vector<matrix_t>& Matrix::data() {
-  return _data;
+// Number of values a thread fills at a time, multiple of the block size 4.
+#define RANDOM_CHUNK_SIZE (16 * 1024)
+
+// Blocks of the generator computed together by a fill, a multiple of the
+// lanes of Rng::blocks().
+#define RANDOM_BATCH_BLOCKS 64
+
+
+template <typename T, int R, int C>
+template <typename F>
+void MatrixT<T, R, C>::_fill_random(const Rng& rng, F fn) {
+  const size_t size = _data.size();
+  const int chunks = (int)((size + RANDOM_CHUNK_SIZE - 1) / RANDOM_CHUNK_SIZE);
+
+  auto fill_chunk = [&](int chunk) {
+    size_t begin = (size_t)chunk * RANDOM_CHUNK_SIZE;
+    size_t end = (begin + RANDOM_CHUNK_SIZE < size) ? begin + RANDOM_CHUNK_SIZE : size;
+
+    // The bits of RANDOM_BATCH_BLOCKS blocks at a time (see Rng::blocks()).
+    uint32_t bits[4 * RANDOM_BATCH_BLOCKS];
+    for (size_t batch = begin; batch < end; batch += 4 * RANDOM_BATCH_BLOCKS) {
+      const size_t values_count = (end - batch < 4 * RANDOM_BATCH_BLOCKS) ? end - batch : 4 * RANDOM_BATCH_BLOCKS;
+      rng.blocks(batch / 4, (values_count + 3) / 4, bits);
+
+      for (size_t j = 0; j < values_count; j += 4) {
+        accum_t values[4];
+        fn(bits + j, values);
+        for (size_t k = 0; k < 4 && j + k < values_count; k++) _store(batch + j + k, values[k]);
+      }
+    }
+  };
+
+  if (chunks > 1) parallel_for(chunks, fill_chunk);
+  else if (chunks == 1) fill_chunk(0);
 }
 
 
-const std::vector<matrix_t>& Matrix::data() const {
-  return _data;
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::randomize(accum_t min, accum_t max) {
+  return randomize(Rng::next(), min, max);
 }
 
 
-int Matrix::rows() const {
-  return _rows;
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::randomize(const Rng& rng, accum_t min, accum_t max) {
+  assert(max > min);
+  float range = (float)(max - min);
+  _fill_random(rng, [&](const uint32_t bits[4], accum_t values[4]) {
+    for (int k = 0; k < 4; k++) {
+      values[k] = (accum_t)(random_float(bits[k]) * range + (float)min);
+    }
+  });
+  return *this;
 }
 
 
-int Matrix::cols() const {
-  return _cols;
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::randomize_normal(const Rng& rng, accum_t mean, accum_t stddev) {
+  // Box-Muller, each pair of uniform values gives two normal values.
+  const float two_pi = 6.28318530718f;
+  _fill_random(rng, [&](const uint32_t bits[4], accum_t values[4]) {
+    for (int k = 0; k < 4; k += 2) {
+      float u1 = 1.f - random_float(bits[k]); // (0, 1] to avoid log(0).
+      float u2 = random_float(bits[k + 1]);
+      float radius = sqrtf(-2.f * logf(u1)) * (float)stddev;
+      values[k]     = (accum_t)(radius * cosf(two_pi * u2) + (float)mean);
+      values[k + 1] = (accum_t)(radius * sinf(two_pi * u2) + (float)mean);
+    }
+  });
+  return *this;
+}
+
+
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::sigmoid() {
+  for (size_t i = 0; i < _data.size(); i++) {
+    _store(i, ::sigmoid(_load(i)));
+  }
+  return *this;
 }
 
 
-void Matrix::print() const {
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::square() {
+  for (size_t i = 0; i < _data.size(); i++) {
+    accum_t val = _load(i);
+    _store(i, val * val);
+  }
+  return *this;
+}
+
+
+template <typename T, int R, int C>
+typename MatrixT<T, R, C>::data_t& MatrixT<T, R, C>::data() {
+  return _data;
+}
+
+
+template <typename T, int R, int C>
+const typename MatrixT<T, R, C>::data_t& MatrixT<T, R, C>::data() const {
+  return _data;
+}
+
+
+template <typename T, int R, int C>
+void MatrixT<T, R, C>::print() const {
   printf("[\n");
-  for (int r = 0; r < _rows; r++) {
+  for (int r = 0; r < rows(); r++) {
     printf("  ");
-    for (int c = 0; c < _cols; c++) {
+    for (int c = 0; c < cols(); c++) {
       if (c != 0) printf(", ");
       // negative number has extra '-' character at the start.
-      matrix_t val = at(r, c);
+      double val = (double)at(r, c);
       if (val >= 0) printf(" %.6f", val);
       else printf("%.6f", val);
     }
@@ -160,56 +989,60 @@ void Matrix::print() const {
 }
 
 
-Matrix& Matrix::operator+=(const Matrix& other) {
-  bool cond = (_rows == other._rows && _cols == other._cols);
-  assert(_rows == other._rows && _cols == other._cols);
-  for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] += other._data[i];
-  }
+template <typename T, int R, int C>
+template <typename E>
+MatrixT<T, R, C>& MatrixT<T, R, C>::operator+=(const MatrixExpr<E>& other) {
+  const E& e = other.self();
+  assert(rows() == e.rows() && cols() == e.cols());
+  parallel_chunks(_data.size(), ELEMENTWISE_CHUNK_SIZE, ELEMENTWISE_PARALLEL_MIN, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) _store(i, _load(i) + e.eval(i));
+  });
   return *this;
 }
 
 
-Matrix& Matrix::operator*=(matrix_t value) {
-  for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] *= value;
-  }
+template <typename T, int R, int C>
+MatrixT<T, R, C>& MatrixT<T, R, C>::operator*=(accum_t value) {
+  parallel_chunks(_data.size(), ELEMENTWISE_CHUNK_SIZE, ELEMENTWISE_PARALLEL_MIN, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) _store(i, _load(i) * value);
+  });
   return *this;
 }
 
 
-Matrix& Matrix::multiply_inplace(const Matrix& other) {
-  assert(_rows == other._rows && _cols == other._cols);
-  for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] *= other._data[i];
-  }
+template <typename T, int R, int C>
+template <typename E>
+MatrixT<T, R, C>& MatrixT<T, R, C>::multiply_inplace(const MatrixExpr<E>& other) {
+  const E& e = other.self();
+  assert(rows() == e.rows() && cols() == e.cols());
+  parallel_chunks(_data.size(), ELEMENTWISE_CHUNK_SIZE, ELEMENTWISE_PARALLEL_MIN, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) _store(i, _load(i) * e.eval(i));
+  });
   return *this;
 }
 
 
-Matrix Matrix::operator-(const Matrix& other) const {
-  assert(_rows == other._rows && _cols == other._cols);
-  Matrix m(this->_rows, this->_cols);
-  for (size_t i = 0; i < _data.size(); i++) {
-    m._data[i] = this->_data[i] - other._data[i];
-  }
-  return m;
-}
-
-
-Matrix Matrix::operator*(const Matrix& other) const {
+template <typename T, int R, int C>
+template <int K>
+MatrixT<T, R, K> MatrixT<T, R, C>::operator*(const MatrixT<T, C, K>& other) const {
 
   // (r1 x c1) * (r2 x c2) =>
   //   assert(c1 == r2), result = (r1 x c2)
-  assert(this->_cols == other._rows);
+  assert(cols() == other.rows());
+
+  MatrixT<T, R, K> m(rows(), other.cols());
 
-  Matrix m(this->_rows, other._cols);
+  if constexpr (R == 0) {
+    gemm<T>(view(), other.view(), m.view());
+    return m;
+  }
 
-  int n = _cols; // Width or a row.
-  for (int r = 0; r < m._rows; r++) {
-    for (int c = 0; c < m._cols; c++) {
+  // Fixed sizes, the trip counts are constants so the compiler can unroll.
+  int n = cols(); // Width or a row.
+  for (int r = 0; r < m.rows(); r++) {
+    for (int c = 0; c < m.cols(); c++) {
 
-      matrix_t val = 0;
+      accum_t val = 0;
       for (int i = 0; i < n; i++) {
         val += this->at(r, i) * other.at(i, c);
       }
@@ -221,35 +1054,120 @@ Matrix Matrix::operator*(const Matrix& other) const {
 }
 
 
-Matrix Matrix::operator*(matrix_t value) const {
-  Matrix m(_rows, _cols);
-  std::vector<matrix_t>& m_data = m.data();
-  for (size_t i = 0; i < _data.size(); i++) {
-    m_data[i] = _data[i] * value;
-  }
+template <typename T, int R, int C>
+MatrixT<T, C, R> MatrixT<T, R, C>::transpose() const {
+  MatrixT<T, C, R> m(cols(), rows());
+  ::transpose<T>(view(), m.view());
   return m;
 }
 
 
-Matrix Matrix::transpose() const {
-  Matrix m(_cols, _rows);
-  for (int r = 0; r < _rows; r++) {
-    for (int c = 0; c < _cols; c++) {
-      m.set(c, r, at(r, c));
-    }
+#ifdef SINGLE_SOURCE_IMPL
+
+
+PackedMatrix::PackedMatrix()
+  : _rows(0), _cols(0), _precision(Precision::FP16)
+{}
+
+
+PackedMatrix& PackedMatrix::pack(const Matrix& m, Precision precision) {
+  assert(precision == Precision::FP16 || precision == Precision::BF16);
+  _rows = m.rows();
+  _cols = m.cols();
+  _precision = precision;
+  _data.resize(m.data().size());
+
+  if (_data.empty()) return *this;
+  if (precision == Precision::FP16) {
+    float_to_fp16(m.data().data(), (fp16_t*)_data.data(), _data.size());
+  } else {
+    float_to_bf16(m.data().data(), (bf16_t*)_data.data(), _data.size());
   }
-  return m;
+  return *this;
 }
 
 
-Matrix Matrix::multiply(const Matrix& other) const {
-  assert(_rows == other._rows && _cols == other._cols);
+Matrix PackedMatrix::unpack() const {
   Matrix m(_rows, _cols);
-  for (size_t i = 0; i < _data.size(); i++) {
-    m._data[i] = _data[i] * other._data[i];
+  for (int r = 0; r < _rows; r++) {
+    unpack_row(r, m.data().data() + (size_t)r * _cols);
   }
   return m;
 }
 
 
+void PackedMatrix::unpack_row(int row, matrix_t* dst) const {
+  const uint16_t* src = _data.data() + (size_t)row * _cols;
+  if (_precision == Precision::FP16) {
+    fp16_to_float((const fp16_t*)src, dst, _cols);
+  } else {
+    bf16_to_float((const bf16_t*)src, dst, _cols);
+  }
+}
+
+
+matrix_t PackedMatrix::at(int row, int col) const {
+  uint16_t bits = _data[row * _cols + col];
+  if (_precision == Precision::FP16) return fp16_to_float(fp16_t{ bits });
+  return bf16_to_float(bf16_t{ bits });
+}
+
+
+void PackedMatrix::clear() {
+  _rows = _cols = 0;
+  _data.clear();
+  _data.shrink_to_fit();
+}
+
+
+bool PackedMatrix::empty() const {
+  return _data.empty();
+}
+
+
+int PackedMatrix::rows() const {
+  return _rows;
+}
+
+
+int PackedMatrix::cols() const {
+  return _cols;
+}
+
+
+Precision PackedMatrix::precision() const {
+  return _precision;
+}
+
+
+void gemm_packed(ConstMatrixView a, const PackedMatrix& b, MatrixView c) {
+  assert(a.cols() == b.rows());
+  assert(c.rows() == a.rows() && c.cols() == b.cols());
+
+  c.fill(0);
+  AlignedBuffer<matrix_t> row(b.cols(), 0);
+
+  // Each packed row is converted once and accumulated into every output row,
+  // so the packed matrix is streamed only once regardless of a.rows().
+  const int n = b.cols();
+  for (int i = 0; i < b.rows(); i++) {
+    b.unpack_row(i, row.data());
+    for (int r = 0; r < a.rows(); r++) {
+      matrix_t scale = a.at(r, i);
+      matrix_t* out = c.row_data(r);
+      for (int j = 0; j < n; j++) {
+        out[j] += scale * row[j];
+      }
+    }
+  }
+}
+
+
+Matrix operator*(const Matrix& m, const PackedMatrix& packed) {
+  Matrix result(m.rows(), packed.cols());
+  gemm_packed(m, packed, result);
+  return result;
+}
+
+
 #endif // SINGLE_SOURCE_IMPL
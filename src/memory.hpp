@@ -0,0 +1,550 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// All the matrix buffers are aligned to a cache line which is also the
+// widest SIMD register (AVX512).
+#define MEMORY_ALIGNMENT 64
+
+
+void* aligned_malloc(size_t size, size_t alignment = MEMORY_ALIGNMENT);
+void aligned_free(void* ptr);
+
+
+// The blocks handed out by MemoryPool to the buffers (the matrix storage) of
+// all the threads, the blocks cached in the pool aren't live. The bytes are
+// the capacities of the blocks.
+struct MemoryStats {
+  int64_t live_bytes = 0;
+  int64_t peak_bytes = 0;  // The largest live_bytes since the last reset.
+  int64_t allocations = 0; // Since the last reset.
+  int64_t frees = 0;
+  int64_t cached_bytes = 0; // Of the blocks cached in the pools of all the threads.
+};
+
+MemoryStats memory_stats();
+
+// Zero the counts and set the peak to the current live bytes.
+void memory_reset_stats();
+
+
+// In debug builds the allocations are also counted per site, the innermost
+// MEMORY_SITE() scope of the allocating thread (or "other"). The names
+// should be literals, in release builds the macro is empty.
+struct MemorySiteStats {
+  const char* name;
+  int64_t allocations;
+  int64_t bytes;
+};
+
+// Sorted by the allocations, empty in release builds.
+std::vector<MemorySiteStats> memory_site_stats();
+void memory_print_sites();
+
+#ifdef DEBUG
+  class MemorySite {
+  public:
+    MemorySite(const char* name);
+    ~MemorySite();
+
+  private:
+    const char* _parent;
+  };
+
+  #define _MEMORY_CONCAT(a, b) a##b
+  #define _MEMORY_NAME(line) _MEMORY_CONCAT(_memory_site_, line)
+  #define MEMORY_SITE(name) MemorySite _MEMORY_NAME(__LINE__)(name)
+#else
+  #define MEMORY_SITE(name)
+#endif
+
+
+// A cache of freed aligned blocks bucketed by power of two sizes. Each thread
+// has its own free lists so there is no locking, a block freed in a different
+// thread than it was allocated just goes to that thread's lists. Temporaries
+// of the same shape are created every training step, with the pool they're
+// recycled instead of going through malloc / free each time.
+class MemoryPool {
+public:
+  ~MemoryPool();
+
+  // Enable or disable pooling for all the threads, when disabled blocks
+  // are allocated and freed directly. It's enabled by default.
+  static void set_enabled(bool enabled);
+  static bool is_enabled();
+
+  // Returns a block of at least size bytes, and the actual size of the
+  // block in capacity which should be passed to free().
+  static void* alloc(size_t size, size_t* capacity);
+  static void free(void* ptr, size_t capacity);
+
+  // Release all the cached blocks of the calling thread to the system.
+  static void trim();
+
+  // Release the cached blocks of all the threads, the calling thread's now
+  // and the other threads' at their next alloc() or free() (ex: between the
+  // benchmarks, or once a large temporary isn't used anymore).
+  static void trim_all();
+
+  // Number of alloc() calls of the calling thread, only counted when
+  // compiled with NN_PROFILE (see profile.hpp).
+  static int64_t allocations();
+
+private:
+  MemoryPool() = default;
+
+  // The pool of the calling thread, or null if it's already destroyed
+  // (buffers freed by static destructors after the thread locals).
+  static MemoryPool* _get();
+
+  void* _alloc(size_t size, size_t* capacity);
+  void _free(void* ptr, size_t capacity);
+  void _trim();
+  void _check_trim(); // Trim if trim_all() was called since the last one.
+
+  // Blocks up to 2^max_bucket bytes (4 MiB) are pooled. A bucket holds at
+  // most max_cached blocks up to 64 KiB and fewer of the larger ones (see
+  // _max_cached()), and the blocks cached by a thread are at most
+  // max_cached_bytes, the rest are freed. The larger allocations (datasets,
+  // large batches) always go to the system so they don't stay resident.
+  static const int min_bucket = 6;
+  static const int max_bucket = 22;
+  static const size_t max_cached = 32;
+  static const size_t max_cached_bytes = (size_t)16 << 20;
+
+  static int _bucket(size_t size);
+  static size_t _max_cached(int bucket);
+
+  std::vector<void*> buckets[max_bucket + 1];
+  size_t cached_bytes = 0;
+  uint64_t trim_generation = 0; // The last trim_all() handled by this thread.
+  static std::atomic<bool> enabled;
+  static std::atomic<uint64_t> trim_requests;
+};
+
+
+// Owns a contiguous aligned array of trivially copyable values, this is the
+// storage of the runtime sized matrices. It's vector like, but the elements
+// are not initialized unless asked, and shrinking or re-initializing it with
+// a size that fits the capacity doesn't re-allocate.
+template <typename T>
+class AlignedBuffer {
+  static_assert(std::is_trivially_copyable<T>::value, "AlignedBuffer is for plain values only.");
+
+public:
+  typedef T value_type;
+
+  AlignedBuffer() = default;
+  AlignedBuffer(size_t count, T val) { assign(count, val); }
+
+  AlignedBuffer(const AlignedBuffer& other) { *this = other; }
+  AlignedBuffer(AlignedBuffer&& other) noexcept { *this = std::move(other); }
+  ~AlignedBuffer() { _release(); }
+
+  AlignedBuffer& operator=(const AlignedBuffer& other) {
+    if (this == &other) return *this;
+    resize(other._size);
+    if (_size > 0) memcpy(_data, other._data, _size * sizeof(T));
+    return *this;
+  }
+
+  AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+    if (this == &other) return *this;
+    _release();
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    std::swap(_capacity, other._capacity);
+    return *this;
+  }
+
+  // Resize to count and fill with val.
+  void assign(size_t count, T val) {
+    resize(count);
+    for (size_t i = 0; i < _size; i++) _data[i] = val;
+  }
+
+  // The existing values are kept, new values are uninitialized.
+  void resize(size_t count) {
+    if (count > _capacity) {
+      size_t capacity = 0;
+      T* data = (T*)MemoryPool::alloc(count * sizeof(T), &capacity);
+      if (_size > 0) memcpy(data, _data, _size * sizeof(T));
+      _release();
+      _data = data;
+      _capacity = capacity / sizeof(T);
+    }
+    _size = count;
+  }
+
+  void clear() { _size = 0; }
+  void shrink_to_fit() { if (_size == 0) _release(); }
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+  bool empty() const { return _size == 0; }
+
+  T* data() { return _data; }
+  const T* data() const { return _data; }
+
+  T& operator[](size_t index) { return _data[index]; }
+  const T& operator[](size_t index) const { return _data[index]; }
+
+  T* begin() { return _data; }
+  T* end() { return _data + _size; }
+  const T* begin() const { return _data; }
+  const T* end() const { return _data + _size; }
+
+private:
+  void _release() {
+    if (_data != nullptr) MemoryPool::free(_data, _capacity * sizeof(T));
+    _data = nullptr;
+    _size = _capacity = 0;
+  }
+
+  T* _data = nullptr;
+  size_t _size = 0;
+  size_t _capacity = 0;
+};
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <mutex>
+
+#ifdef _WIN32
+  #include <malloc.h>
+#endif
+
+
+std::atomic<bool> MemoryPool::enabled(true);
+std::atomic<uint64_t> MemoryPool::trim_requests(0);
+
+
+static std::atomic<int64_t> _memory_live(0);
+static std::atomic<int64_t> _memory_peak(0);
+static std::atomic<int64_t> _memory_allocations(0);
+static std::atomic<int64_t> _memory_frees(0);
+static std::atomic<int64_t> _memory_cached(0);
+
+#ifdef DEBUG
+  static thread_local const char* _memory_site = nullptr;
+
+  MemorySite::MemorySite(const char* name) : _parent(_memory_site) { _memory_site = name; }
+  MemorySite::~MemorySite() { _memory_site = _parent; }
+
+
+  // The counts of the sites of a thread, merged by memory_site_stats(). The
+  // mutex of a table is only contended by the reports, and a thread adds its
+  // counts to _memory_sites_retired when it exits.
+  struct _MemorySiteTable {
+    std::mutex mutex;
+    std::vector<MemorySiteStats> sites; // A few, searched linearly.
+
+    _MemorySiteTable();
+    ~_MemorySiteTable();
+  };
+
+  static std::mutex _memory_sites_mutex; // Of the tables and the retired counts.
+  static std::vector<_MemorySiteTable*> _memory_site_tables;
+  static std::vector<MemorySiteStats> _memory_sites_retired;
+  static thread_local bool _memory_sites_destroyed = false;
+
+
+  static void _memory_sites_add(std::vector<MemorySiteStats>& sites, const MemorySiteStats& add) {
+    for (MemorySiteStats& site : sites) {
+      if (site.name == add.name) {
+        site.allocations += add.allocations;
+        site.bytes += add.bytes;
+        return;
+      }
+    }
+    sites.push_back(add);
+  }
+
+
+  _MemorySiteTable::_MemorySiteTable() {
+    std::lock_guard<std::mutex> lock(_memory_sites_mutex);
+    _memory_site_tables.push_back(this);
+  }
+
+
+  _MemorySiteTable::~_MemorySiteTable() {
+    std::lock_guard<std::mutex> lock(_memory_sites_mutex);
+    for (const MemorySiteStats& site : sites) _memory_sites_add(_memory_sites_retired, site);
+    _memory_site_tables.erase(std::find(_memory_site_tables.begin(), _memory_site_tables.end(), this));
+    _memory_sites_destroyed = true;
+  }
+
+
+  // The table of the calling thread, or null if it's already destroyed.
+  static _MemorySiteTable* _memory_site_table() {
+    static thread_local _MemorySiteTable table;
+    if (_memory_sites_destroyed) return nullptr;
+    return &table;
+  }
+#endif
+
+
+static void _memory_track_alloc(size_t capacity) {
+  _memory_allocations.fetch_add(1, std::memory_order_relaxed);
+  int64_t live = _memory_live.fetch_add((int64_t) capacity, std::memory_order_relaxed) + (int64_t) capacity;
+  int64_t peak = _memory_peak.load(std::memory_order_relaxed);
+  while (live > peak && !_memory_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+
+#ifdef DEBUG
+  const MemorySiteStats site = { (_memory_site != nullptr) ? _memory_site : "other", 1, (int64_t) capacity };
+  _MemorySiteTable* table = _memory_site_table();
+  if (table != nullptr) {
+    std::lock_guard<std::mutex> lock(table->mutex);
+    _memory_sites_add(table->sites, site);
+  } else {
+    std::lock_guard<std::mutex> lock(_memory_sites_mutex);
+    _memory_sites_add(_memory_sites_retired, site);
+  }
+#endif
+}
+
+
+static void _memory_track_free(size_t capacity) {
+  _memory_frees.fetch_add(1, std::memory_order_relaxed);
+  _memory_live.fetch_sub((int64_t) capacity, std::memory_order_relaxed);
+}
+
+
+MemoryStats memory_stats() {
+  MemoryStats stats;
+  stats.live_bytes = _memory_live.load();
+  stats.peak_bytes = _memory_peak.load();
+  stats.allocations = _memory_allocations.load();
+  stats.frees = _memory_frees.load();
+  stats.cached_bytes = _memory_cached.load();
+  return stats;
+}
+
+
+void memory_reset_stats() {
+  _memory_allocations.store(0);
+  _memory_frees.store(0);
+  _memory_peak.store(_memory_live.load());
+#ifdef DEBUG
+  std::lock_guard<std::mutex> lock(_memory_sites_mutex);
+  _memory_sites_retired.clear();
+  for (_MemorySiteTable* table : _memory_site_tables) {
+    std::lock_guard<std::mutex> table_lock(table->mutex);
+    table->sites.clear();
+  }
+#endif
+}
+
+
+std::vector<MemorySiteStats> memory_site_stats() {
+  std::vector<MemorySiteStats> sites;
+#ifdef DEBUG
+  {
+    std::lock_guard<std::mutex> lock(_memory_sites_mutex);
+    sites = _memory_sites_retired;
+    for (_MemorySiteTable* table : _memory_site_tables) {
+      std::lock_guard<std::mutex> table_lock(table->mutex);
+      for (const MemorySiteStats& site : table->sites) _memory_sites_add(sites, site);
+    }
+  }
+  std::sort(sites.begin(), sites.end(), [](const MemorySiteStats& a, const MemorySiteStats& b) {
+    return a.allocations > b.allocations;
+  });
+#endif
+  return sites;
+}
+
+
+void memory_print_sites() {
+  std::vector<MemorySiteStats> sites = memory_site_stats();
+  if (sites.empty()) return;
+  printf("%-24s %12s %12s\n", "allocation site", "allocations", "MiB");
+  for (const MemorySiteStats& site : sites) {
+    printf("%-24s %12lld %12.2f\n", site.name, (long long) site.allocations, site.bytes / (1024. * 1024.));
+  }
+}
+
+
+void* aligned_malloc(size_t size, size_t alignment) {
+  // aligned_alloc requires the size to be a multiple of the alignment.
+  size = (size + alignment - 1) & ~(alignment - 1);
+#ifdef _WIN32
+  void* ptr = _aligned_malloc(size, alignment);
+#else
+  void* ptr = aligned_alloc(alignment, size);
+#endif
+  assert(ptr != nullptr && "Out of memory.");
+  return ptr;
+}
+
+
+void aligned_free(void* ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  ::free(ptr);
+#endif
+}
+
+
+static thread_local bool _pool_destroyed = false;
+
+#ifdef NN_PROFILE
+  static thread_local int64_t _pool_allocations = 0;
+#endif
+
+
+MemoryPool::~MemoryPool() {
+  _trim();
+  _pool_destroyed = true;
+}
+
+
+MemoryPool* MemoryPool::_get() {
+  static thread_local MemoryPool pool;
+  if (_pool_destroyed) return nullptr;
+  return &pool;
+}
+
+
+void MemoryPool::set_enabled(bool enabled) {
+  MemoryPool::enabled.store(enabled);
+}
+
+
+bool MemoryPool::is_enabled() {
+  return enabled.load(std::memory_order_relaxed);
+}
+
+
+int MemoryPool::_bucket(size_t size) {
+  int bucket = min_bucket;
+  while (((size_t)1 << bucket) < size) bucket++;
+  return bucket;
+}
+
+
+size_t MemoryPool::_max_cached(int bucket) {
+  // Halved for every doubling above 64 KiB, at least 2 (a temporary and the
+  // one replacing it).
+  if (bucket <= 16) return max_cached;
+  size_t count = max_cached >> (bucket - 16);
+  return (count > 2) ? count : 2;
+}
+
+
+void* MemoryPool::alloc(size_t size, size_t* capacity) {
+#ifdef NN_PROFILE
+  _pool_allocations++;
+#endif
+  void* ptr;
+  MemoryPool* pool = (is_enabled()) ? _get() : nullptr;
+  if (pool != nullptr) {
+    ptr = pool->_alloc(size, capacity);
+  } else {
+    *capacity = (size + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1);
+    ptr = aligned_malloc(*capacity);
+  }
+  _memory_track_alloc(*capacity);
+  return ptr;
+}
+
+
+void MemoryPool::free(void* ptr, size_t capacity) {
+  if (ptr == nullptr) return;
+  _memory_track_free(capacity);
+  MemoryPool* pool = (is_enabled()) ? _get() : nullptr;
+  if (pool != nullptr) pool->_free(ptr, capacity);
+  else aligned_free(ptr);
+}
+
+
+void MemoryPool::trim() {
+  MemoryPool* pool = _get();
+  if (pool != nullptr) pool->_trim();
+}
+
+
+void MemoryPool::trim_all() {
+  trim_requests.fetch_add(1);
+  trim();
+}
+
+
+int64_t MemoryPool::allocations() {
+#ifdef NN_PROFILE
+  return _pool_allocations;
+#else
+  return 0;
+#endif
+}
+
+
+void* MemoryPool::_alloc(size_t size, size_t* capacity) {
+  assert(capacity != nullptr);
+
+  _check_trim();
+
+  if (size == 0) size = 1;
+  int bucket = _bucket(size);
+  if (bucket > max_bucket) {
+    *capacity = (size + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1);
+    return aligned_malloc(*capacity);
+  }
+
+  *capacity = (size_t)1 << bucket;
+  std::vector<void*>& list = buckets[bucket];
+  if (!list.empty()) {
+    void* ptr = list.back();
+    list.pop_back();
+    cached_bytes -= *capacity;
+    _memory_cached.fetch_sub((int64_t) *capacity, std::memory_order_relaxed);
+    return ptr;
+  }
+  return aligned_malloc(*capacity);
+}
+
+
+void MemoryPool::_free(void* ptr, size_t capacity) {
+  _check_trim();
+
+  // Only the blocks with an exact bucket size could come from the pool.
+  int bucket = _bucket(capacity);
+  if (bucket <= max_bucket && ((size_t)1 << bucket) == capacity &&
+      buckets[bucket].size() < _max_cached(bucket) &&
+      cached_bytes + capacity <= max_cached_bytes) {
+    buckets[bucket].push_back(ptr);
+    cached_bytes += capacity;
+    _memory_cached.fetch_add((int64_t) capacity, std::memory_order_relaxed);
+    return;
+  }
+  aligned_free(ptr);
+}
+
+
+void MemoryPool::_trim() {
+  for (std::vector<void*>& list : buckets) {
+    for (void* ptr : list) aligned_free(ptr);
+    list.clear();
+  }
+  _memory_cached.fetch_sub((int64_t) cached_bytes, std::memory_order_relaxed);
+  cached_bytes = 0;
+  trim_generation = trim_requests.load(std::memory_order_relaxed);
+}
+
+
+void MemoryPool::_check_trim() {
+  if (trim_generation != trim_requests.load(std::memory_order_relaxed)) _trim();
+}
+
+#endif // SINGLE_SOURCE_IMPL
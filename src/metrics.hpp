@@ -0,0 +1,171 @@
+#pragma once
+
+#include "nn.hpp"
+
+#include <string>
+#include <vector>
+
+// Number of samples of a forward pass of evaluate_classification(), the
+// outputs of a batch should fit in the L2 cache.
+#define EVALUATE_BATCH_SIZE 32
+
+
+// The predictions of a classifier over a dataset, the class of a sample is
+// the index of its largest output and the classes are named by the labels of
+// the model.
+struct ClassificationReport {
+  std::vector<std::string> labels;
+
+  // confusion[expected * classes() + predicted] is the number of samples of
+  // the expected class predicted as the other.
+  std::vector<int> confusion;
+
+  int count = 0;
+  int correct = 0;
+
+  ClassificationReport(const std::vector<std::string>& labels = {});
+
+  int classes() const { return (int) labels.size(); }
+  int at(int expected, int predicted) const { return confusion[expected * classes() + predicted]; }
+
+  float accuracy() const;
+
+  // Of the samples predicted as the class, the fraction which are of it.
+  float precision(int label) const;
+
+  // Of the samples of the class, the fraction which are predicted as it.
+  float recall(int label) const;
+
+  // Add the counts of the other report.
+  void merge(const ClassificationReport& other);
+
+  // The accuracy, the per class precision / recall and the confusion
+  // matrix as a table.
+  void print() const;
+};
+
+
+// Index of the largest value of the row.
+int argmax(ConstMatrixView row);
+
+// Classify the samples [begin, begin + count) of the dataset. The samples
+// are split into chunks evaluated in parallel, and each chunk is forwarded in
+// batches of EVALUATE_BATCH_SIZE rows.
+ClassificationReport evaluate_classification(const NN& nn, const Dataset& dataset, int begin, int count);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+
+ClassificationReport::ClassificationReport(const std::vector<std::string>& labels)
+  : labels(labels), confusion(labels.size() * labels.size(), 0) {}
+
+
+float ClassificationReport::accuracy() const {
+  return (count > 0) ? (float) correct / count : 0.f;
+}
+
+
+float ClassificationReport::precision(int label) const {
+  int predicted = 0;
+  for (int i = 0; i < classes(); i++) predicted += at(i, label);
+  return (predicted > 0) ? (float) at(label, label) / predicted : 0.f;
+}
+
+
+float ClassificationReport::recall(int label) const {
+  int expected = 0;
+  for (int i = 0; i < classes(); i++) expected += at(label, i);
+  return (expected > 0) ? (float) at(label, label) / expected : 0.f;
+}
+
+
+void ClassificationReport::merge(const ClassificationReport& other) {
+  assert(other.confusion.size() == confusion.size());
+  for (size_t i = 0; i < confusion.size(); i++) confusion[i] += other.confusion[i];
+  count += other.count;
+  correct += other.correct;
+}
+
+
+void ClassificationReport::print() const {
+  printf("accuracy: %.2f%% (%d / %d)\n\n", accuracy() * 100, correct, count);
+
+  printf("%-10s %10s %10s\n", "label", "precision", "recall");
+  for (int i = 0; i < classes(); i++) {
+    printf("%-10s %9.2f%% %9.2f%%\n", labels[i].c_str(), precision(i) * 100, recall(i) * 100);
+  }
+
+  // Rows are the expected classes and columns the predicted ones.
+  printf("\nconfusion (expected \\ predicted):\n%-10s", "");
+  for (int i = 0; i < classes(); i++) printf(" %6s", labels[i].c_str());
+  printf("\n");
+  for (int i = 0; i < classes(); i++) {
+    printf("%-10s", labels[i].c_str());
+    for (int j = 0; j < classes(); j++) printf(" %6d", at(i, j));
+    printf("\n");
+  }
+}
+
+
+int argmax(ConstMatrixView row) {
+  int index = 0;
+  const matrix_t* values = row.row_data(0);
+  for (int i = 1; i < row.cols(); i++) {
+    if (values[i] > values[index]) index = i;
+  }
+  return index;
+}
+
+
+ClassificationReport evaluate_classification(const NN& nn, const Dataset& dataset, int begin, int count) {
+  assert(begin >= 0 && count >= 0 && begin + count <= dataset.count());
+  const int classes = (int) nn.output_labels.size();
+  const int input_size = nn.graph.input_shape.size();
+
+  const int chunk_count = (count + EVALUATE_CHUNK_SIZE - 1) / EVALUATE_CHUNK_SIZE;
+  std::vector<ClassificationReport> reports(chunk_count, ClassificationReport(nn.output_labels));
+
+  parallel_for(chunk_count, [&](int chunk) {
+    TRACE_SCOPE("evaluate chunk", "eval");
+    MEMORY_SITE("evaluate");
+    ClassificationReport& report = reports[chunk];
+    int first = begin + chunk * EVALUATE_CHUNK_SIZE;
+    int last = std::min(first + EVALUATE_CHUNK_SIZE, begin + count);
+
+    InferenceWorkspace workspace;
+    Matrix outputs(EVALUATE_BATCH_SIZE, classes);
+    Matrix inputs; // If the dataset can't give a view of the batch.
+
+    for (int index = first; index < last; index += EVALUATE_BATCH_SIZE) {
+      const int rows = std::min(EVALUATE_BATCH_SIZE, last - index);
+
+      ConstMatrixView batch = dataset.input_batch(index, rows);
+      if (batch.data() == nullptr) {
+        inputs.init(rows, input_size);
+        for (int r = 0; r < rows; r++) {
+          MatrixView(inputs).row(r).assign(ConstMatrixView(dataset.get_input(index + r)));
+        }
+        batch = inputs;
+      }
+
+      MatrixView out = MatrixView(outputs).rows(0, rows);
+      nn.predict(batch, out, workspace);
+
+      for (int r = 0; r < rows; r++) {
+        int expected = dataset.get_label(index + r);
+        int predicted = argmax(out.row(r));
+        assert(expected >= 0 && expected < classes);
+        report.confusion[expected * classes + predicted]++;
+        if (predicted == expected) report.correct++;
+        report.count++;
+      }
+    }
+  });
+
+  ClassificationReport report(nn.output_labels);
+  for (const ClassificationReport& r : reports) report.merge(r);
+  return report;
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -1,220 +1,512 @@
 #pragma once
 
 #include "matrix.hpp"
-
+#include "activation.hpp"
+#include "conv.hpp"
+#include "graph.hpp"
+#include "nodes.hpp"
+#include "optimizer.hpp"
+#include "numa.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
 #include <vector>
 #include <filesystem>
 #include <fstream>
 
 namespace fs = std::filesystem;
 
+// Number of samples evaluated by a task of NN::evaluate().
+#define EVALUATE_CHUNK_SIZE 256
+
 class Dataset {
 public:
   virtual int count() const = 0;
   virtual Matrix get_input(int index) const = 0;
   virtual Matrix get_output(int index) const = 0;
-};
 
+  // If the dataset keeps its inputs as matrix_t, returns a view of the input
+  // without copying it, otherwise an empty view and get_input() should be
+  // used instead.
+  virtual ConstMatrixView input_view(int /*index*/) const { return ConstMatrixView(); }
+
+  // The inputs [index, index + count) as the rows of a view, or an empty view
+  // if they're not stored that way.
+  virtual ConstMatrixView input_batch(int /*index*/, int /*count*/) const { return ConstMatrixView(); }
+
+  // The class of a classification sample, the index of its largest output.
+  virtual int get_label(int index) const;
+};
 
-struct Layer {
-  Matrix outputs;
-  Matrix biased;
-  Matrix weights;
 
-  Layer(int neuron_count = 0);
-  Layer(Layer&& other) noexcept;
+// A layer of the NN constructor. The first one is the input of the model,
+// only its shape is used. Dense and conv2d layers are followed by their
+// activation (a separate node, fused by the graph), the other types are the
+// node alone.
+struct LayerConfig {
+  NodeType type = NodeType::DENSE;
+  Activation activation = Activation::SIGMOID;
+  ImageShape shape; // Of the input, or (neurons, 1, 1) for dense.
+  int filters = 0;  // Conv2d.
+  int kernel = 1;   // Conv2d and pooling.
+  int stride = 1;
+  int padding = 0;
+  float rate = 0;   // Dropout.
+
+  static LayerConfig input(int channels, int height = 1, int width = 1);
+  static LayerConfig dense(int neurons, Activation activation = Activation::SIGMOID);
+  static LayerConfig conv2d(int filters, int kernel, Activation activation = Activation::RELU,
+                            int stride = 1, int padding = 0);
+  static LayerConfig max_pool(int size);
+  static LayerConfig avg_pool(int size);
+  static LayerConfig activation_layer(Activation activation);
+  static LayerConfig dropout(float rate);
+  static LayerConfig layer_norm();
+};
 
-  // Create the next layer from current updating the weights.
-  Layer next_layer(int neuron_count);
 
-  static void forward(Layer& curr, Layer& prev);
+// A copy of the state of the model the other threads read while it trains
+// (see NN::publish()).
+struct NNSnapshot {
+  std::vector<Matrix> parameters;    // In the order of graph.parameters().
+  std::vector<Matrix> layer_outputs; // Of the last forward(), see Graph::layer_outputs().
+  int trained = 0;
+  int data_index = 0;
+  int64_t steps = 0;                 // Of the optimizer.
 };
 
 
 struct NN {
 
   matrix_t learn_rate = 0.01;
-  std::vector<Layer> layers;
+  Precision weight_precision = Precision::FP32;
+  Optimizer optimizer = Optimizer(OptimizerType::SGD);
+  Graph graph;
   std::vector<std::string> output_labels;
 
   int trained = 0;    // Number of times the model trained on the dataset.
   int data_index = 0; // Index in the dataset to the next training data.
 
   NN();
-  NN(const std::vector<int>& config, const std::vector<std::string>& output_labels);
 
-  Matrix& get_outputs();
+  // config is the neuron count of each layer and activations the activation
+  // of each layer after the input (all sigmoid if empty). The weights of
+  // layer i are generated from the stream i - 1 of the seed, so the same
+  // seed gives the same model.
+  NN(const std::vector<int>& config, const std::vector<std::string>& output_labels,
+     const std::vector<Activation>& activations = {},
+     WeightInit init = WeightInit::UNIFORM, uint64_t seed = RANDOM_DEFAULT_SEED);
+
+  // A model of any layer types, ex:
+  //   { LayerConfig::input(1, 28, 28), LayerConfig::conv2d(8, 5),
+  //     LayerConfig::max_pool(2), LayerConfig::dense(10, Activation::SOFTMAX) }
+  NN(const std::vector<LayerConfig>& config, const std::vector<std::string>& output_labels,
+     WeightInit init = WeightInit::UNIFORM, uint64_t seed = RANDOM_DEFAULT_SEED);
 
-  void forward(const Matrix& input);
+  // Outputs of the last forward().
+  const Matrix& get_outputs() const;
+
+  void forward(ConstMatrixView input);
   void backprop(const Matrix& expected);
 
+  // Outputs for the input without modifying the model (thread safe). The
+  // workspace should be kept by the caller (one per thread) and reused so the
+  // inference doesn't allocate.
+  void predict(ConstMatrixView input, MatrixView output, InferenceWorkspace& workspace) const;
+  Matrix predict(ConstMatrixView input) const;
+
+  // The loss the model is trained on, cross entropy for a softmax output
+  // and squared error otherwise.
+  float loss(ConstMatrixView out, ConstMatrixView exp) const;
+
+  // Floating point operations of the forward pass of a sample (a multiply
+  // add is 2), and the number of weights and biases.
+  int64_t forward_flops() const;
+  int64_t parameter_count() const;
+
+  // Mean loss of the samples [begin, begin + count) of the dataset, they're
+  // evaluated in parallel and the result doesn't depend on the thread count.
+  float evaluate(const Dataset& dataset, int begin, int count) const;
+
+  // Change the optimizer, this resets the optimizer state.
+  void set_optimizer(OptimizerType type, const OptimizerParams& params = OptimizerParams());
+
+  // Store the weights of the dense nodes in the given precision for the
+  // forward pass. If the master (fp32) weights are kept, backprop will update
+  // them and re-pack, otherwise they're dropped and the model can only be
+  // used for inference.
+  void set_weight_precision(Precision precision, bool keep_master = true);
+
   void save(const char* path) const;
+
+  // Loads both the graph files and the older files of layers.
   void load(const char* path);
+
+  // Publish a copy of the parameters and the layer outputs as the next
+  // version of snapshot(), called by the training thread between the steps.
+  // The readers of the other threads (the ui, an evaluator, a checkpoint
+  // writer...) use the snapshot instead of the model, so they see a
+  // consistent version and never block the training.
+  void publish();
+
+  // The last published version, null before the first publish(). It can be
+  // called from any thread, and the snapshot stays valid while it's held.
+  std::shared_ptr<const Snapshot<NNSnapshot>> snapshot() const;
+
+  // Copy the parameters of a snapshot of a model with the same layers, ex:
+  // to update a replica which evaluates, predicts or is saved in another
+  // thread.
+  void load_snapshot(const NNSnapshot& snapshot);
+
+private:
+  void _load_layers(std::ifstream& file, int trained);
+
+  // Spread the pages of the parameters over the numa nodes if it's enabled,
+  // they're read by all the threads of the pool (see numa.hpp).
+  void _interleave_parameters();
+
+  SnapshotPublisher<NNSnapshot> _snapshots;
 };
 
 
-float error(Matrix& out, Matrix& exp);
+// Squared error summed over all the rows (samples) of out, divided by the
+// number of outputs.
+float error(ConstMatrixView out, ConstMatrixView exp);
+
+// Cross entropy -sum(exp * log(out)) summed over all the rows (samples) of
+// out, where the rows of out are probabilities (softmax).
+float cross_entropy(ConstMatrixView out, ConstMatrixView exp);
 
 
 #ifdef SINGLE_SOURCE_IMPL
 
 
-float error(Matrix& out, Matrix& exp) {
+int Dataset::get_label(int index) const {
+  Matrix output = get_output(index);
+  int label = 0;
+  for (int i = 1; i < output.cols(); i++) {
+    if (output.at(0, i) > output.at(0, label)) label = i;
+  }
+  return label;
+}
+
+
+float error(ConstMatrixView out, ConstMatrixView exp) {
   return (out - exp).square().sum() / out.cols();
 }
 
 
-Layer::Layer(int neuron_count) {
-  outputs.init(1, neuron_count);
-  biased.init(1, neuron_count);
+float cross_entropy(ConstMatrixView out, ConstMatrixView exp) {
+  assert(out.rows() == exp.rows() && out.cols() == exp.cols());
+
+  // The probability is clamped so a confident wrong output gives a large
+  // loss instead of inf.
+  const matrix_t min_probability = (matrix_t) 1e-7;
+  double loss = 0;
+  for (int r = 0; r < out.rows(); r++) {
+    const matrix_t* p = out.row_data(r);
+    const matrix_t* y = exp.row_data(r);
+    for (int i = 0; i < out.cols(); i++) {
+      if (y[i] == 0) continue;
+      matrix_t probability = (p[i] > min_probability) ? p[i] : min_probability;
+      loss -= y[i] * logf(probability);
+    }
+  }
+  return (float) loss;
+}
+
+
+LayerConfig LayerConfig::input(int channels, int height, int width) {
+  LayerConfig config;
+  config.shape = { channels, height, width };
+  return config;
+}
+
+
+LayerConfig LayerConfig::dense(int neurons, Activation activation) {
+  LayerConfig config;
+  config.activation = activation;
+  config.shape = { neurons, 1, 1 };
+  return config;
+}
+
+
+LayerConfig LayerConfig::conv2d(int filters, int kernel, Activation activation, int stride, int padding) {
+  LayerConfig config;
+  config.type = NodeType::CONV2D;
+  config.activation = activation;
+  config.filters = filters;
+  config.kernel = kernel;
+  config.stride = stride;
+  config.padding = padding;
+  return config;
 }
 
 
-Layer Layer::next_layer(int neuron_count) {
-  Layer next;
-  next.outputs.init(1, neuron_count);
-  next.biased.init(1, neuron_count);
-  this->weights.init(this->outputs.cols(), next.outputs.cols());
-  return next;
+LayerConfig LayerConfig::max_pool(int size) {
+  LayerConfig config;
+  config.type = NodeType::MAX_POOL;
+  config.activation = Activation::LINEAR;
+  config.kernel = config.stride = size;
+  return config;
 }
 
 
-Layer::Layer(Layer&& other) noexcept :
-  outputs(std::move(other.outputs)),
-  biased(std::move(other.biased)),
-  weights(std::move(other.weights))
-{}
+LayerConfig LayerConfig::avg_pool(int size) {
+  LayerConfig config = max_pool(size);
+  config.type = NodeType::AVG_POOL;
+  return config;
+}
+
+
+LayerConfig LayerConfig::activation_layer(Activation activation) {
+  LayerConfig config;
+  config.type = NodeType::ACTIVATION;
+  config.activation = activation;
+  return config;
+}
+
+
+LayerConfig LayerConfig::dropout(float rate) {
+  LayerConfig config;
+  config.type = NodeType::DROPOUT;
+  config.activation = Activation::LINEAR;
+  config.rate = rate;
+  return config;
+}
 
 
-void Layer::forward(Layer& curr, Layer& prev) {
-  curr.outputs = (
-    (prev.outputs * prev.weights) += curr.biased
-  ).sigmoid();
+LayerConfig LayerConfig::layer_norm() {
+  LayerConfig config;
+  config.type = NodeType::LAYER_NORM;
+  config.activation = Activation::LINEAR;
+  return config;
 }
 
 
 NN::NN() {}
 
 
-NN::NN(const std::vector<int>& config, const std::vector<std::string>& output_labels)
+static std::vector<LayerConfig> _dense_config(const std::vector<int>& config,
+                                               const std::vector<Activation>& activations) {
+  assert(config.size() >= 1);
+  assert(activations.empty() || activations.size() == config.size() - 1);
+
+  std::vector<LayerConfig> layers;
+  layers.push_back(LayerConfig::input(config[0]));
+  for (size_t i = 1; i < config.size(); i++) {
+    Activation activation = (activations.empty()) ? Activation::SIGMOID : activations[i - 1];
+    layers.push_back(LayerConfig::dense(config[i], activation));
+  }
+  return layers;
+}
+
+
+NN::NN(const std::vector<int>& config, const std::vector<std::string>& output_labels,
+       const std::vector<Activation>& activations, WeightInit init, uint64_t seed)
+  : NN(_dense_config(config, activations), output_labels, init, seed) {}
+
+
+NN::NN(const std::vector<LayerConfig>& config, const std::vector<std::string>& output_labels,
+       WeightInit init, uint64_t seed)
   : output_labels(output_labels) {
 
   assert(config.size() >= 1);
-  assert(output_labels.size() == config.at(config.size() - 1));
-
-  for (size_t i = 0; i < config.size(); i++) {
-    int neurons_count = config[i];
-    if (i == 0) {
-      layers.push_back(Layer(neurons_count));
-    } else {
-      Layer& prev = layers.at(layers.size() - 1);
-      layers.push_back(prev.next_layer(neurons_count));
+
+  // The node of each layer is initialized from the stream of its layer.
+  std::vector<std::pair<Node*, uint64_t>> streams;
+
+  for (size_t i = 1; i < config.size(); i++) {
+    const LayerConfig& c = config[i];
+    std::unique_ptr<Node> node;
+
+    switch (c.type) {
+      case NodeType::DENSE:      node = std::make_unique<DenseNode>(c.shape.size()); break;
+      case NodeType::CONV2D:     node = std::make_unique<Conv2DNode>(c.filters, c.kernel, c.stride, c.padding); break;
+      case NodeType::MAX_POOL:   node = std::make_unique<PoolNode>(PoolType::MAX, c.kernel, c.stride, c.padding); break;
+      case NodeType::AVG_POOL:   node = std::make_unique<PoolNode>(PoolType::AVG, c.kernel, c.stride, c.padding); break;
+      case NodeType::ACTIVATION: node = std::make_unique<ActivationNode>(c.activation); break;
+      case NodeType::DROPOUT:    node = std::make_unique<DropoutNode>(c.rate); break;
+      case NodeType::LAYER_NORM: node = std::make_unique<LayerNormNode>(); break;
+    }
+
+    streams.push_back({ node.get(), i - 1 });
+    graph.add(std::move(node));
+
+    bool has_activation = c.type == NodeType::DENSE || c.type == NodeType::CONV2D;
+    if (has_activation && c.activation != Activation::LINEAR) {
+      graph.add(std::make_unique<ActivationNode>(c.activation));
     }
   }
 
-  for (Layer& layer : layers) {
-    layer.weights.randomize(-.5, .5);
+  graph.compile(config[0].shape);
+  assert((int) output_labels.size() == graph.output_shape().size());
+
+  for (auto& [node, stream] : streams) {
+    node->init(init, Rng(seed, stream));
   }
+  _interleave_parameters();
 }
 
 
-Matrix& NN::get_outputs() {
-  return layers[layers.size() - 1].outputs;
+const Matrix& NN::get_outputs() const {
+  return graph.layer_outputs(graph.layer_count() - 1);
 }
 
 
-void NN::forward(const Matrix& input) {
-  layers[0].outputs = input;
-  for (size_t i = 1; i < layers.size(); i++) {
-    Layer& curr = layers[i];
-    Layer& prev = layers[i - 1];
-    Layer::forward(curr, prev);
-  }
+void NN::forward(ConstMatrixView input) {
+  TRACE_SCOPE("forward", "train");
+  MEMORY_SITE("forward");
+  graph.forward(input);
 }
 
 
-void NN::backprop(const Matrix& expected) {
-  Matrix& output = layers[layers.size() - 1].outputs;
-  assert(expected.rows() == output.rows() &&
-         expected.cols() == output.cols());
+void NN::predict(ConstMatrixView input, MatrixView output, InferenceWorkspace& workspace) const {
+  graph.predict(input, output, workspace);
+}
+
 
-  // delta_out = out - exp
-  // delta_hidden = w.trans() * next_delta x (a * (1-a))
-  //
-  // curr_b += -learn_rate * curr_delta
-  // prev_w += -learn_rate * (curr_delta.trans() * prev_active)
+Matrix NN::predict(ConstMatrixView input) const {
+  return graph.predict(input);
+}
 
-  Matrix delta = output - expected;
-  for (size_t i = layers.size() - 1; i > 0; i--) {
-    Layer& curr = layers[i];
-    Layer& prev = layers[i - 1];
 
-    curr.biased += (delta * (-learn_rate));
-    prev.weights += (prev.outputs.transpose() * delta) * (-learn_rate);
+int64_t NN::forward_flops() const {
+  return graph.flops();
+}
 
-    // sigmoid_derivative = (a * (1 - a));
-    Matrix one = Matrix(prev.outputs.rows(), prev.outputs.cols(), 1);
-    Matrix sigmoid_derivative = prev.outputs.multiply(one - prev.outputs);
 
-    // delta_next = (delta * prev.w.trans()) x (a * (1-a));
-    delta = (delta * prev.weights.transpose()).multiply_inplace(sigmoid_derivative);
-  }
+int64_t NN::parameter_count() const {
+  return graph.parameter_count();
 }
 
 
-static void write_matrix(std::ofstream& file, const Matrix& m) {
-  int rows = m.rows(), cols = m.cols();
-  assert(m.data().size() == rows * cols);
+float NN::loss(ConstMatrixView out, ConstMatrixView exp) const {
+  if (graph.output_activation() == Activation::SOFTMAX) return cross_entropy(out, exp);
+  return error(out, exp);
+}
 
-  file.write((const char*) &rows, sizeof rows);
-  file.write((const char*) &cols, sizeof cols);
 
-  for (matrix_t val : m.data()) {
-    file.write((const char*)&val, sizeof val);
-  }
+float NN::evaluate(const Dataset& dataset, int begin, int count) const {
+  assert(begin >= 0 && count >= 0 && begin + count <= dataset.count());
+  if (count == 0) return 0.f;
+  TRACE_SCOPE("validate", "eval");
+  MEMORY_SITE("validate");
+
+  // Each chunk sums its errors and the chunks are added in order.
+  const int chunk_count = (count + EVALUATE_CHUNK_SIZE - 1) / EVALUATE_CHUNK_SIZE;
+  std::vector<double> errors(chunk_count, 0);
+
+  parallel_for(chunk_count, [&](int chunk) {
+    int first = begin + chunk * EVALUATE_CHUNK_SIZE;
+    int last = std::min(first + EVALUATE_CHUNK_SIZE, begin + count);
+    double sum = 0;
+    InferenceWorkspace workspace;
+    Matrix outputs(1, graph.output_shape().size());
+    for (int index = first; index < last; index++) {
+      ConstMatrixView input = dataset.input_view(index);
+      if (input.data() != nullptr) predict(input, outputs, workspace);
+      else predict(dataset.get_input(index), outputs, workspace);
+      sum += loss(outputs, dataset.get_output(index));
+    }
+    errors[chunk] = sum;
+  });
+
+  double total = 0;
+  for (double sum : errors) total += sum;
+  return (float)(total / count);
 }
 
 
-static Matrix read_matrix(std::ifstream& file) {
-  int rows, cols;
-  file.read((char*)&rows, sizeof rows);
-  file.read((char*)&cols, sizeof cols);
-  assert(rows >= 0 && cols >= 0);
+void NN::backprop(const Matrix& expected) {
+  const Matrix& output = get_outputs();
+  assert(expected.rows() == output.rows() &&
+         expected.cols() == output.cols());
+
+  // delta_out = out - exp, which is the gradient of the cross entropy for a
+  // softmax output (p - y), and of sigmoid with binary cross entropy. The
+  // graph propagates it back and writes the gradients of all the parameters,
+  // which are applied after so every delta is of the current weights.
+  optimizer.step();
+  {
+    TRACE_SCOPE("backward", "train");
+    MEMORY_SITE("backward");
+    Matrix delta = output - expected;
+    graph.backward(delta);
+  }
+
+  // The parameter index (of the optimizer state) is the order of the
+  // parameters in the graph.
+  TRACE_SCOPE("update", "train");
+  MEMORY_SITE("update");
+  PROFILE_ONLY(ProfileTimer timer;)
+  const std::vector<Parameter>& params = graph.parameters();
+  for (size_t i = 0; i < params.size(); i++) {
+    optimizer.update((int) i, *params[i].value, *params[i].grad, learn_rate);
+  }
 
-  Matrix m(rows, cols);
-  std::vector<matrix_t>& data = m.data();
-  for (size_t i = 0; i < rows * cols; i++) {
-    matrix_t val;
-    file.read((char*)&val, sizeof val);
-    data[i] = val;
+  if (weight_precision != Precision::FP32) {
+    for (std::unique_ptr<Node>& node : graph.nodes) {
+      if (node->type() != NodeType::DENSE) continue;
+      DenseNode& dense = static_cast<DenseNode&>(*node);
+      dense.packed.pack(dense.weights, weight_precision);
+    }
   }
 
-  return m;
+  PROFILE_ONLY(graph.profile().update_calls++; graph.profile().update_ns += timer.ns();)
 }
 
 
+void NN::set_optimizer(OptimizerType type, const OptimizerParams& params) {
+  optimizer = Optimizer(type, params);
+}
+
+
+void NN::set_weight_precision(Precision precision, bool keep_master) {
+  weight_precision = precision;
+  for (std::unique_ptr<Node>& node : graph.nodes) {
+    if (node->type() != NodeType::DENSE) continue;
+    static_cast<DenseNode&>(*node).set_precision(precision, keep_master);
+  }
+}
+
+
+// The first int of the graph files, the older files start with the trained
+// count instead.
+#define NN_FILE_MAGIC 0x46474e4e // "NNGF"
+#define NN_FILE_VERSION 1
+
+
 void NN::save(const char* path) const {
+  TRACE_SCOPE("checkpoint", "io");
+  MEMORY_SITE("checkpoint");
 
   std::ofstream file(path, std::ios::binary);
   assert(!!file);
 
-  file.write((const char*)(&trained), sizeof trained);
-  file.write((const char*)(&data_index), sizeof data_index);
-
-  int layer_count = (int) layers.size();
-  file.write((const char*)(&layer_count), sizeof layer_count);
-
-  for (const Layer& layer : layers) {
-    int activation_count = (int) layer.outputs.cols();
+  int header[] = {
+    NN_FILE_MAGIC, NN_FILE_VERSION, trained, data_index,
+    graph.input_shape.channels, graph.input_shape.height, graph.input_shape.width,
+    (int) graph.nodes.size(),
+  };
+  file.write((const char*)(header), sizeof header);
+
+  for (const std::unique_ptr<Node>& node : graph.nodes) {
+    int type = (int) node->type();
+    file.write((const char*)(&type), sizeof type);
+    node->save(file);
+  }
 
-    assert(
-      layer.outputs.rows() == 1 &&
-      layer.biased.rows() == 1 &&
-      activation_count == layer.biased.cols()
-    );
+  int optimizer_type = (int) optimizer.type;
+  file.write((const char*)(&optimizer_type), sizeof optimizer_type);
+  file.write((const char*)(&optimizer.params), sizeof optimizer.params);
+  file.write((const char*)(&optimizer.steps), sizeof optimizer.steps);
 
-    write_matrix(file, layer.biased);
-    write_matrix(file, layer.weights);
+  int state_count = (int) optimizer.state.size();
+  file.write((const char*)(&state_count), sizeof state_count);
+  for (const Matrix& state : optimizer.state) {
+    write_matrix(file, state);
   }
 
   file.close();
@@ -222,42 +514,147 @@ void NN::save(const char* path) const {
 
 
 void NN::load(const char* path) {
-
-  // TODO: What if it has layers already.
-  //assert(layers.size() == 0 && "Cannot load to an already built nn.");
-  layers.clear();
+  TRACE_SCOPE("load model", "io");
+  MEMORY_SITE("load model");
 
   std::ifstream file(path, std::ios::binary);
   assert(!!file && "Cannot open the nn file.");
 
-  file.read((char*)(&trained), sizeof trained);
+  graph = Graph();
+
+  int magic;
+  file.read((char*)(&magic), sizeof magic);
+  if (magic != NN_FILE_MAGIC) {
+    _load_layers(file, magic);
+    set_weight_precision(weight_precision);
+    _interleave_parameters();
+    return;
+  }
+
+  int header[7];
+  file.read((char*)(header), sizeof header);
+  assert(header[0] == NN_FILE_VERSION && "Unknown nn file version.");
+  trained = header[1];
+  data_index = header[2];
+  ImageShape input_shape = { header[3], header[4], header[5] };
+  int node_count = header[6];
+  assert(node_count >= 0);
+
+  for (int i = 0; i < node_count; i++) {
+    int type;
+    file.read((char*)(&type), sizeof type);
+    assert(type >= 0 && type <= (int) NodeType::LAYER_NORM);
+    std::unique_ptr<Node> node = create_node((NodeType) type);
+    node->load(file);
+    graph.add(std::move(node));
+  }
+  graph.compile(input_shape);
+
+  int optimizer_type;
+  file.read((char*)(&optimizer_type), sizeof optimizer_type);
+  assert(optimizer_type >= 0 && optimizer_type <= (int) OptimizerType::ADAM);
+  optimizer.type = (OptimizerType) optimizer_type;
+  file.read((char*)(&optimizer.params), sizeof optimizer.params);
+  file.read((char*)(&optimizer.steps), sizeof optimizer.steps);
+
+  int state_count;
+  file.read((char*)(&state_count), sizeof state_count);
+  assert(state_count >= 0);
+  optimizer.state.clear();
+  for (int i = 0; i < state_count; i++) {
+    optimizer.state.push_back(read_matrix(file));
+  }
+
+  set_weight_precision(weight_precision);
+  _interleave_parameters();
+}
+
+
+// The files before the graph are a list of layers, each with its biases and
+// the weights to the next layer. All the layers after the input are dense
+// with a sigmoid, and there is no optimizer state.
+void NN::_load_layers(std::ifstream& file, int trained) {
+  this->trained = trained;
   file.read((char*)(&data_index), sizeof data_index);
 
   int layer_count;
   file.read((char*)&layer_count, sizeof layer_count);
-  assert(layer_count >= 0);
+  assert(layer_count >= 1);
 
+  std::vector<Matrix> biases(layer_count);
+  std::vector<Matrix> weights(layer_count);
   for (int i = 0; i < layer_count; i++) {
+    biases[i] = read_matrix(file);
+    assert(biases[i].rows() == 1);
+    weights[i] = read_matrix(file);
+  }
 
-    Layer l;
+  for (int i = 1; i < layer_count; i++) {
+    auto node = std::make_unique<DenseNode>(biases[i].cols());
+    node->weights = std::move(weights[i - 1]);
+    node->bias = std::move(biases[i]);
+    graph.add(std::move(node));
+    graph.add(std::make_unique<ActivationNode>(Activation::SIGMOID));
+  }
 
-    l.biased = read_matrix(file);
-    assert(l.biased.rows() == 1);
+  graph.compile({ biases[0].cols(), 1, 1 });
+  assert(graph.output_shape().size() == biases.back().cols());
 
-    l.outputs.init(1, l.biased.cols());
-    l.weights = read_matrix(file);
+  optimizer.steps = 0;
+  optimizer.state.clear();
+}
 
-    layers.push_back(std::move(l));
-  }
 
-  // Assert the dimentions are valid.
-  for (size_t i = 0; i < layers.size() - 1; i++) {
-    const Layer& curr = layers[i];
-    const Layer& next = layers[i + 1];
-    assert(curr.weights.rows() == curr.outputs.cols());
-    assert(curr.weights.cols() == next.outputs.cols());
+void NN::publish() {
+  TRACE_SCOPE("publish");
+  MEMORY_SITE("publish");
+
+  _snapshots.publish([&](NNSnapshot& snapshot) {
+    const std::vector<Parameter>& params = graph.parameters();
+    snapshot.parameters.resize(params.size());
+    for (size_t i = 0; i < params.size(); i++) snapshot.parameters[i] = *params[i].value;
+
+    snapshot.layer_outputs.resize(graph.layer_count());
+    for (int i = 0; i < graph.layer_count(); i++) snapshot.layer_outputs[i] = graph.layer_outputs(i);
+
+    snapshot.trained = trained;
+    snapshot.data_index = data_index;
+    snapshot.steps = optimizer.steps;
+  });
+}
+
+
+std::shared_ptr<const Snapshot<NNSnapshot>> NN::snapshot() const {
+  return _snapshots.get();
+}
+
+
+void NN::load_snapshot(const NNSnapshot& snapshot) {
+  const std::vector<Parameter>& params = graph.parameters();
+  assert(snapshot.parameters.size() == params.size() && "The snapshot is of a different model.");
+
+  for (size_t i = 0; i < params.size(); i++) {
+    const Matrix& value = snapshot.parameters[i];
+    // Empty if the master weights of the snapshot's model were dropped.
+    if (value.data().empty()) continue;
+    const Matrix& current = *params[i].value;
+    assert((current.data().empty() || (value.rows() == current.rows() && value.cols() == current.cols())) &&
+           "The snapshot is of a different model.");
+    *params[i].value = value;
   }
+  trained = snapshot.trained;
+  data_index = snapshot.data_index;
 
+  // Re-pack the weights stored in a lower precision.
+  if (weight_precision != Precision::FP32) set_weight_precision(weight_precision);
+}
+
+
+void NN::_interleave_parameters() {
+  if (!numa_enabled()) return;
+  for (const Parameter& param : graph.parameters()) {
+    numa_interleave(param.value->data().data(), param.value->data().size() * sizeof(matrix_t));
+  }
 }
 
 #endif // SINGLE_SOURCE_IMPL
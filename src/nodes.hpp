@@ -0,0 +1,709 @@
+#pragma once
+
+#include "graph.hpp"
+
+#include <memory>
+
+
+// outputs = inputs * weights + bias, weights is (inputs x units).
+class DenseNode : public Node {
+public:
+  DenseNode(int units = 0);
+
+  NodeType type() const override { return NodeType::DENSE; }
+  ImageShape build(const ImageShape& input) override;
+  void init(WeightInit init, const Rng& rng) override;
+  void forward(ConstMatrixView input, MatrixView output) const override;
+  void backward(ConstMatrixView input, ConstMatrixView output,
+                ConstMatrixView output_grad, MatrixView input_grad) override;
+  void parameters(std::vector<Parameter>& params) override;
+  int64_t flops() const override;
+  void save(std::ofstream& file) const override;
+  void load(std::ifstream& file) override;
+
+  // Returns the weight from the fp32 weights if we have it, otherwise from
+  // the packed weights.
+  matrix_t weight(int row, int col) const;
+
+  // Store the weights in the given precision for the forward pass, see
+  // NN::set_weight_precision().
+  void set_precision(Precision precision, bool keep_master);
+
+  int units;
+  int inputs = 0;
+  Matrix weights;
+  Matrix bias;
+
+  // Reduced precision copy of the weights, if not empty it'll be used in the
+  // forward pass instead of the weights matrix.
+  PackedMatrix packed;
+
+  Matrix weight_grads;
+  Matrix bias_grads;
+};
+
+
+// Convolution of the input image with the filters, see conv2d_forward().
+class Conv2DNode : public Node {
+public:
+  Conv2DNode(int filters = 0, int kernel = 1, int stride = 1, int padding = 0);
+
+  NodeType type() const override { return NodeType::CONV2D; }
+  ImageShape build(const ImageShape& input) override;
+  void init(WeightInit init, const Rng& rng) override;
+  void forward(ConstMatrixView input, MatrixView output) const override;
+  void forward_scratch(ConstMatrixView input, MatrixView output,
+                       InferenceWorkspace& workspace) const override;
+  void forward_train(ConstMatrixView input, MatrixView output) override;
+  void backward(ConstMatrixView input, ConstMatrixView output,
+                ConstMatrixView output_grad, MatrixView input_grad) override;
+  void parameters(std::vector<Parameter>& params) override;
+  int64_t flops() const override;
+  void save(std::ofstream& file) const override;
+  void load(std::ifstream& file) override;
+
+  int filters;
+  ConvWindow window; // Over the input image.
+  Matrix weights;    // (channels * kernel * kernel x filters).
+  Matrix bias;       // (1 x filters).
+
+  Matrix weight_grads;
+  Matrix bias_grads;
+
+  // The im2col columns of a sample for forward_train() and backward(), and
+  // their gradient (patch_size x positions).
+  Matrix cols;
+  Matrix cols_grad;
+};
+
+
+// Max or average pooling of each channel, no parameters.
+class PoolNode : public Node {
+public:
+  PoolNode(PoolType pool = PoolType::MAX, int kernel = 2, int stride = 2, int padding = 0);
+
+  NodeType type() const override;
+  ImageShape build(const ImageShape& input) override;
+  void forward(ConstMatrixView input, MatrixView output) const override;
+  void backward(ConstMatrixView input, ConstMatrixView output,
+                ConstMatrixView output_grad, MatrixView input_grad) override;
+  int64_t flops() const override;
+  void save(std::ofstream& file) const override;
+  void load(std::ifstream& file) override;
+
+  PoolType pool;
+  ConvWindow window;
+  ImageShape shape; // Of the outputs.
+};
+
+
+// outputs = f(inputs), usually fused into the node before it by the graph.
+class ActivationNode : public Node {
+public:
+  ActivationNode(Activation activation = Activation::LINEAR);
+
+  NodeType type() const override { return NodeType::ACTIVATION; }
+  ImageShape build(const ImageShape& input) override { return input; }
+  void forward(ConstMatrixView input, MatrixView output) const override;
+  void backward(ConstMatrixView input, ConstMatrixView output,
+                ConstMatrixView output_grad, MatrixView input_grad) override;
+  Activation activation() const override { return _activation; }
+  bool in_place() const override { return true; }
+  bool needs_output() const override { return true; }
+  void save(std::ofstream& file) const override;
+  void load(std::ifstream& file) override;
+
+private:
+  Activation _activation;
+};
+
+
+// Inverted dropout: while training each input is zeroed with the probability
+// rate and the others are scaled by 1 / (1 - rate), so the inference is the
+// identity. The masks are drawn from the rng given to init(), the same seed
+// gives the same training.
+class DropoutNode : public Node {
+public:
+  DropoutNode(float rate = .5f);
+
+  NodeType type() const override { return NodeType::DROPOUT; }
+  ImageShape build(const ImageShape& input) override { return input; }
+  void init(WeightInit init, const Rng& rng) override;
+  void forward(ConstMatrixView input, MatrixView output) const override;
+  void forward_train(ConstMatrixView input, MatrixView output) override;
+  void backward(ConstMatrixView input, ConstMatrixView output,
+                ConstMatrixView output_grad, MatrixView input_grad) override;
+  bool in_place() const override { return true; }
+  void save(std::ofstream& file) const override;
+  void load(std::ifstream& file) override;
+
+  float rate;
+
+private:
+  Rng _rng;
+  uint64_t _offset = 0; // Index in the rng stream of the next mask, on a block.
+  Matrix _mask;         // 0 or the scale, of the last forward_train().
+};
+
+
+// Normalize each sample to zero mean and unit variance over its features,
+// then scale and shift per feature: outputs = gain * (x - mean) / sqrt(var +
+// epsilon) + bias.
+class LayerNormNode : public Node {
+public:
+  LayerNormNode(float epsilon = 1e-5f);
+
+  NodeType type() const override { return NodeType::LAYER_NORM; }
+  ImageShape build(const ImageShape& input) override;
+  void init(WeightInit init, const Rng& rng) override;
+  void forward(ConstMatrixView input, MatrixView output) const override;
+  void backward(ConstMatrixView input, ConstMatrixView output,
+                ConstMatrixView output_grad, MatrixView input_grad) override;
+  void parameters(std::vector<Parameter>& params) override;
+  int64_t flops() const override;
+  void save(std::ofstream& file) const override;
+  void load(std::ifstream& file) override;
+
+  float epsilon;
+  Matrix gain; // (1 x features).
+  Matrix bias;
+
+  Matrix gain_grads;
+  Matrix bias_grads;
+};
+
+
+// An empty node of the type, its configuration is set by Node::load().
+std::unique_ptr<Node> create_node(NodeType type);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+
+// Initialize the weights (fan_in x fan_out).
+static void _init_weights(Matrix& weights, WeightInit init, const Rng& rng) {
+  float fan_in = (float) weights.rows(), fan_out = (float) weights.cols();
+
+  switch (init) {
+    case WeightInit::UNIFORM:
+      weights.randomize(rng, -.5, .5);
+      break;
+
+    case WeightInit::XAVIER: {
+      float limit = sqrtf(6.f / (fan_in + fan_out));
+      weights.randomize(rng, -limit, limit);
+    } break;
+
+    case WeightInit::HE:
+      weights.randomize_normal(rng, 0, sqrtf(2.f / fan_in));
+      break;
+  }
+}
+
+
+// Sum of the rows of m into sums (1 x cols).
+static void _sum_rows(ConstMatrixView m, MatrixView sums) {
+  assert(sums.rows() == 1 && sums.cols() == m.cols());
+  sums.fill(0);
+  matrix_t* s = sums.row_data(0);
+  for (int r = 0; r < m.rows(); r++) {
+    const matrix_t* row = m.row_data(r);
+    for (int i = 0; i < m.cols(); i++) s[i] += row[i];
+  }
+}
+
+
+// Add bias (1 x cols) to each row of m.
+static void _add_rows(MatrixView m, ConstMatrixView bias) {
+  assert(bias.rows() == 1 && bias.cols() == m.cols());
+  const matrix_t* b = bias.row_data(0);
+  for (int r = 0; r < m.rows(); r++) {
+    matrix_t* row = m.row_data(r);
+    for (int i = 0; i < m.cols(); i++) row[i] += b[i];
+  }
+}
+
+
+// output = input, unless they're the same buffer (in place).
+static void _copy_if_not_same(ConstMatrixView input, MatrixView output) {
+  assert(input.rows() == output.rows() && input.cols() == output.cols());
+  if (input.data() != output.data()) output.assign(input);
+}
+
+
+DenseNode::DenseNode(int units) : units(units) {}
+
+
+ImageShape DenseNode::build(const ImageShape& input) {
+  inputs = input.size();
+  assert(weights.data().size() == 0 || (weights.rows() == inputs && weights.cols() == units));
+  if (packed.empty()) _graph_reshape(weights, inputs, units);
+  _graph_reshape(bias, 1, units);
+  return { units, 1, 1 };
+}
+
+
+void DenseNode::init(WeightInit init, const Rng& rng) {
+  _init_weights(weights, init, rng);
+  bias.fill(0);
+}
+
+
+void DenseNode::forward(ConstMatrixView input, MatrixView output) const {
+  if (packed.empty()) gemm<matrix_t>(input, weights, output, 1, 0);
+  else gemm_packed(input, packed, output);
+  _add_rows(output, bias);
+}
+
+
+void DenseNode::backward(ConstMatrixView input, ConstMatrixView /*output*/,
+                         ConstMatrixView output_grad, MatrixView input_grad) {
+  assert(weights.rows() == inputs && "Cannot train without the master weights.");
+
+  // grad_w = input.trans() * output_grad, grad_b = sum of output_grad
+  _graph_reshape(weight_grads, inputs, units);
+  _graph_reshape(bias_grads, 1, units);
+  gemm<matrix_t>(input, output_grad, weight_grads, 1, 0, true, false);
+  _sum_rows(output_grad, bias_grads);
+
+  // input_grad = output_grad * w.trans()
+  if (input_grad.data() != nullptr) {
+    gemm<matrix_t>(output_grad, weights, input_grad, 1, 0, false, true);
+  }
+}
+
+
+void DenseNode::parameters(std::vector<Parameter>& params) {
+  params.push_back({ &weights, &weight_grads });
+  params.push_back({ &bias, &bias_grads });
+}
+
+
+int64_t DenseNode::flops() const {
+  return 2 * (int64_t) inputs * units;
+}
+
+
+void DenseNode::save(std::ofstream& file) const {
+  file.write((const char*)(&units), sizeof units);
+  if (weights.data().size() == 0 && !packed.empty()) {
+    write_matrix(file, packed.unpack());
+  } else {
+    write_matrix(file, weights);
+  }
+  write_matrix(file, bias);
+}
+
+
+void DenseNode::load(std::ifstream& file) {
+  file.read((char*)(&units), sizeof units);
+  weights = read_matrix(file);
+  bias = read_matrix(file);
+  packed.clear();
+  assert(units > 0 && weights.cols() == units && bias.rows() == 1 && bias.cols() == units);
+}
+
+
+matrix_t DenseNode::weight(int row, int col) const {
+  if (weights.data().size() == 0) return packed.at(row, col);
+  return weights.at(row, col);
+}
+
+
+void DenseNode::set_precision(Precision precision, bool keep_master) {
+  if (precision == Precision::FP32) {
+    if (weights.data().size() == 0 && !packed.empty()) {
+      weights = packed.unpack();
+    }
+    packed.clear();
+    return;
+  }
+
+  if (weights.data().size() != 0) {
+    packed.pack(weights, precision);
+  } else if (!packed.empty()) {
+    packed.pack(packed.unpack(), precision);
+  }
+  if (!keep_master) weights = Matrix(); // Release the buffer.
+}
+
+
+Conv2DNode::Conv2DNode(int filters, int kernel, int stride, int padding) : filters(filters) {
+  window.kernel = kernel;
+  window.stride = stride;
+  window.padding = padding;
+}
+
+
+ImageShape Conv2DNode::build(const ImageShape& input) {
+  window.input = input;
+  ImageShape shape = { filters, window.out_height(), window.out_width() };
+  assert(shape.size() > 0 && "The layer has no outputs, the kernel is larger than the input.");
+
+  assert(weights.data().size() == 0 || (weights.rows() == window.patch_size() && weights.cols() == filters));
+  _graph_reshape(weights, window.patch_size(), filters);
+  _graph_reshape(bias, 1, filters);
+  _graph_reshape(cols, window.patch_size(), window.positions());
+  _graph_reshape(cols_grad, window.patch_size(), window.positions());
+  return shape;
+}
+
+
+void Conv2DNode::init(WeightInit init, const Rng& rng) {
+  _init_weights(weights, init, rng);
+  bias.fill(0);
+}
+
+
+void Conv2DNode::forward(ConstMatrixView input, MatrixView output) const {
+  Matrix scratch(window.patch_size(), window.positions());
+  conv2d_forward(window, input, weights, bias, output, scratch);
+}
+
+
+void Conv2DNode::forward_scratch(ConstMatrixView input, MatrixView output,
+                                 InferenceWorkspace& workspace) const {
+  workspace.scratch.resize((size_t) window.patch_size() * window.positions());
+  MatrixView scratch(workspace.scratch.data(), window.patch_size(), window.positions());
+  conv2d_forward(window, input, weights, bias, output, scratch);
+}
+
+
+void Conv2DNode::forward_train(ConstMatrixView input, MatrixView output) {
+  conv2d_forward(window, input, weights, bias, output, cols);
+}
+
+
+void Conv2DNode::backward(ConstMatrixView input, ConstMatrixView /*output*/,
+                          ConstMatrixView output_grad, MatrixView input_grad) {
+  _graph_reshape(weight_grads, weights.rows(), weights.cols());
+  _graph_reshape(bias_grads, 1, filters);
+  conv2d_backward(window, input, weights, output_grad, weight_grads, bias_grads, input_grad,
+                  cols, cols_grad);
+}
+
+
+void Conv2DNode::parameters(std::vector<Parameter>& params) {
+  params.push_back({ &weights, &weight_grads });
+  params.push_back({ &bias, &bias_grads });
+}
+
+
+int64_t Conv2DNode::flops() const {
+  return 2 * (int64_t) window.patch_size() * filters * window.positions();
+}
+
+
+void Conv2DNode::save(std::ofstream& file) const {
+  int values[] = { filters, window.kernel, window.stride, window.padding };
+  file.write((const char*)(values), sizeof values);
+  write_matrix(file, weights);
+  write_matrix(file, bias);
+}
+
+
+void Conv2DNode::load(std::ifstream& file) {
+  int values[4];
+  file.read((char*)(values), sizeof values);
+  filters = values[0];
+  window.kernel = values[1];
+  window.stride = values[2];
+  window.padding = values[3];
+  weights = read_matrix(file);
+  bias = read_matrix(file);
+  assert(filters > 0 && weights.cols() == filters && bias.rows() == 1 && bias.cols() == filters);
+}
+
+
+PoolNode::PoolNode(PoolType pool, int kernel, int stride, int padding) : pool(pool) {
+  window.kernel = kernel;
+  window.stride = stride;
+  window.padding = padding;
+}
+
+
+NodeType PoolNode::type() const {
+  return (pool == PoolType::MAX) ? NodeType::MAX_POOL : NodeType::AVG_POOL;
+}
+
+
+ImageShape PoolNode::build(const ImageShape& input) {
+  window.input = input;
+  shape = { input.channels, window.out_height(), window.out_width() };
+  assert(shape.size() > 0 && "The layer has no outputs, the kernel is larger than the input.");
+  return shape;
+}
+
+
+void PoolNode::forward(ConstMatrixView input, MatrixView output) const {
+  pool_forward(pool, window, input, output);
+}
+
+
+void PoolNode::backward(ConstMatrixView input, ConstMatrixView /*output*/,
+                        ConstMatrixView output_grad, MatrixView input_grad) {
+  if (input_grad.data() != nullptr) pool_backward(pool, window, input, output_grad, input_grad);
+}
+
+
+int64_t PoolNode::flops() const {
+  return (int64_t) window.kernel * window.kernel * shape.size();
+}
+
+
+void PoolNode::save(std::ofstream& file) const {
+  int values[] = { window.kernel, window.stride, window.padding };
+  file.write((const char*)(values), sizeof values);
+}
+
+
+void PoolNode::load(std::ifstream& file) {
+  int values[3];
+  file.read((char*)(values), sizeof values);
+  window.kernel = values[0];
+  window.stride = values[1];
+  window.padding = values[2];
+}
+
+
+ActivationNode::ActivationNode(Activation activation) : _activation(activation) {}
+
+
+void ActivationNode::forward(ConstMatrixView input, MatrixView output) const {
+  _copy_if_not_same(input, output);
+  activation_forward(_activation, output);
+}
+
+
+void ActivationNode::backward(ConstMatrixView /*input*/, ConstMatrixView output,
+                              ConstMatrixView output_grad, MatrixView input_grad) {
+  if (input_grad.data() == nullptr) return;
+  input_grad.assign(output_grad);
+  activation_backward(_activation, output, input_grad);
+}
+
+
+void ActivationNode::save(std::ofstream& file) const {
+  int activation = (int) _activation;
+  file.write((const char*)(&activation), sizeof activation);
+}
+
+
+void ActivationNode::load(std::ifstream& file) {
+  int activation;
+  file.read((char*)(&activation), sizeof activation);
+  assert(activation >= 0 && activation <= (int) Activation::LINEAR);
+  _activation = (Activation) activation;
+}
+
+
+DropoutNode::DropoutNode(float rate) : rate(rate) {
+  assert(rate >= 0 && rate < 1);
+}
+
+
+void DropoutNode::init(WeightInit /*init*/, const Rng& rng) {
+  _rng = rng;
+  _offset = 0;
+}
+
+
+void DropoutNode::forward(ConstMatrixView input, MatrixView output) const {
+  _copy_if_not_same(input, output);
+}
+
+
+void DropoutNode::forward_train(ConstMatrixView input, MatrixView output) {
+  const int rows = input.rows(), cols = input.cols();
+  const matrix_t scale = 1 / (1 - rate);
+  _graph_reshape(_mask, rows, cols);
+  MatrixView masks = _mask;
+
+  // The values of the masks are consecutive in the stream from a block
+  // boundary, all 4 values of a block are used.
+  uint64_t block = (_offset + 3) / 4;
+  size_t remaining = (size_t) rows * cols;
+  uint32_t bits[4 * RANDOM_BATCH_BLOCKS];
+  size_t next = 0, available = 0;
+
+  for (int r = 0; r < rows; r++) {
+    const matrix_t* x = input.row_data(r);
+    matrix_t* y = output.row_data(r);
+    matrix_t* mask = masks.row_data(r);
+    for (int i = 0; i < cols; i++) {
+      if (next == available) {
+        size_t count = std::min((size_t) RANDOM_BATCH_BLOCKS, (remaining + 3) / 4);
+        _rng.blocks(block, count, bits);
+        block += count;
+        available = 4 * count;
+        next = 0;
+      }
+      mask[i] = (random_float(bits[next++]) < rate) ? 0 : scale;
+      y[i] = x[i] * mask[i];
+      remaining--;
+    }
+  }
+  _offset = block * 4;
+}
+
+
+void DropoutNode::backward(ConstMatrixView /*input*/, ConstMatrixView /*output*/,
+                           ConstMatrixView output_grad, MatrixView input_grad) {
+  if (input_grad.data() == nullptr) return;
+  assert(_mask.rows() == output_grad.rows() && _mask.cols() == output_grad.cols());
+  ConstMatrixView masks = _mask;
+
+  for (int r = 0; r < output_grad.rows(); r++) {
+    const matrix_t* g = output_grad.row_data(r);
+    const matrix_t* mask = masks.row_data(r);
+    matrix_t* d = input_grad.row_data(r);
+    for (int i = 0; i < output_grad.cols(); i++) d[i] = g[i] * mask[i];
+  }
+}
+
+
+void DropoutNode::save(std::ofstream& file) const {
+  uint64_t values[] = { _rng.seed(), _rng.stream(), _offset };
+  file.write((const char*)(&rate), sizeof rate);
+  file.write((const char*)(values), sizeof values);
+}
+
+
+void DropoutNode::load(std::ifstream& file) {
+  uint64_t values[3];
+  file.read((char*)(&rate), sizeof rate);
+  file.read((char*)(values), sizeof values);
+  assert(rate >= 0 && rate < 1);
+  _rng = Rng(values[0], values[1]);
+  _offset = values[2];
+}
+
+
+LayerNormNode::LayerNormNode(float epsilon) : epsilon(epsilon) {}
+
+
+ImageShape LayerNormNode::build(const ImageShape& input) {
+  _graph_reshape(gain, 1, input.size());
+  _graph_reshape(bias, 1, input.size());
+  return input;
+}
+
+
+void LayerNormNode::init(WeightInit /*init*/, const Rng& /*rng*/) {
+  gain.fill(1);
+  bias.fill(0);
+}
+
+
+// Mean and 1 / stddev of the n values.
+static void _layer_norm_stats(const matrix_t* x, int n, float epsilon, matrix_t* mean, matrix_t* inv_std) {
+  matrix_t sum = 0;
+  for (int i = 0; i < n; i++) sum += x[i];
+  matrix_t m = sum / n;
+
+  matrix_t var = 0;
+  for (int i = 0; i < n; i++) var += (x[i] - m) * (x[i] - m);
+  var /= n;
+
+  *mean = m;
+  *inv_std = 1 / sqrtf(var + epsilon);
+}
+
+
+void LayerNormNode::forward(ConstMatrixView input, MatrixView output) const {
+  const int n = input.cols();
+  const matrix_t* g = gain.data().data();
+  const matrix_t* b = bias.data().data();
+
+  for (int r = 0; r < input.rows(); r++) {
+    const matrix_t* x = input.row_data(r);
+    matrix_t* y = output.row_data(r);
+    matrix_t mean, inv_std;
+    _layer_norm_stats(x, n, epsilon, &mean, &inv_std);
+    for (int i = 0; i < n; i++) y[i] = g[i] * (x[i] - mean) * inv_std + b[i];
+  }
+}
+
+
+// With x_hat = (x - mean) * inv_std and dx_hat = output_grad * gain:
+//   input_grad = inv_std * (dx_hat - mean(dx_hat) - x_hat * mean(dx_hat * x_hat))
+// the statistics are recomputed from the inputs instead of kept.
+void LayerNormNode::backward(ConstMatrixView input, ConstMatrixView /*output*/,
+                             ConstMatrixView output_grad, MatrixView input_grad) {
+  const int n = input.cols();
+  const bool has_input_grad = input_grad.data() != nullptr;
+  const matrix_t* g = gain.data().data();
+
+  _graph_reshape(gain_grads, 1, n);
+  _graph_reshape(bias_grads, 1, n);
+  gain_grads.fill(0);
+  _sum_rows(output_grad, bias_grads);
+  matrix_t* gain_grad = gain_grads.data().data();
+
+  for (int r = 0; r < input.rows(); r++) {
+    const matrix_t* x = input.row_data(r);
+    const matrix_t* dy = output_grad.row_data(r);
+    matrix_t mean, inv_std;
+    _layer_norm_stats(x, n, epsilon, &mean, &inv_std);
+
+    matrix_t dx_hat_mean = 0, dx_hat_x_hat_mean = 0;
+    for (int i = 0; i < n; i++) {
+      matrix_t x_hat = (x[i] - mean) * inv_std;
+      gain_grad[i] += dy[i] * x_hat;
+      dx_hat_mean += dy[i] * g[i];
+      dx_hat_x_hat_mean += dy[i] * g[i] * x_hat;
+    }
+    if (!has_input_grad) continue;
+
+    dx_hat_mean /= n;
+    dx_hat_x_hat_mean /= n;
+    matrix_t* dx = input_grad.row_data(r);
+    for (int i = 0; i < n; i++) {
+      matrix_t x_hat = (x[i] - mean) * inv_std;
+      dx[i] = inv_std * (dy[i] * g[i] - dx_hat_mean - x_hat * dx_hat_x_hat_mean);
+    }
+  }
+}
+
+
+void LayerNormNode::parameters(std::vector<Parameter>& params) {
+  params.push_back({ &gain, &gain_grads });
+  params.push_back({ &bias, &bias_grads });
+}
+
+
+int64_t LayerNormNode::flops() const {
+  // Mean, variance, normalize, scale and shift.
+  return 8 * (int64_t) gain.cols();
+}
+
+
+void LayerNormNode::save(std::ofstream& file) const {
+  file.write((const char*)(&epsilon), sizeof epsilon);
+  write_matrix(file, gain);
+  write_matrix(file, bias);
+}
+
+
+void LayerNormNode::load(std::ifstream& file) {
+  file.read((char*)(&epsilon), sizeof epsilon);
+  gain = read_matrix(file);
+  bias = read_matrix(file);
+  assert(gain.rows() == 1 && bias.rows() == 1 && gain.cols() == bias.cols());
+}
+
+
+std::unique_ptr<Node> create_node(NodeType type) {
+  switch (type) {
+    case NodeType::DENSE:      return std::make_unique<DenseNode>();
+    case NodeType::CONV2D:     return std::make_unique<Conv2DNode>();
+    case NodeType::MAX_POOL:   return std::make_unique<PoolNode>(PoolType::MAX);
+    case NodeType::AVG_POOL:   return std::make_unique<PoolNode>(PoolType::AVG);
+    case NodeType::ACTIVATION: return std::make_unique<ActivationNode>();
+    case NodeType::DROPOUT:    return std::make_unique<DropoutNode>();
+    case NodeType::LAYER_NORM: return std::make_unique<LayerNormNode>();
+  }
+  return nullptr;
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Placement of the memory and the threads on the numa nodes of a multi
+// socket machine, it's optional and off by default. Without it the buffers
+// shared by all the threads (the parameters of the model, the inputs of the
+// datasets) are on the node of the thread which first touched them, and the
+// threads of the pool of the other sockets read them over the interconnect.
+//
+// When enabled these buffers are interleaved page by page over the nodes so
+// their reads are spread over all the memory controllers, and the worker
+// threads of the pool are pinned (see set_parallel_affinity()) so the
+// temporaries of their thread local pools (see MemoryPool) stay on the node
+// which touched them first.
+//
+// It's implemented for linux with the mbind syscall and the cpu lists of
+// sysfs (no libnuma). On the other systems, or a single node, it's a no-op.
+
+
+// Enable the interleaving of the shared buffers by numa_interleave(), it
+// should be set before the datasets and the models are created.
+void set_numa_enabled(bool enabled);
+bool numa_enabled();
+
+// The numa nodes of the machine, 1 if it can't be read.
+int numa_nodes();
+
+// The cpus the process can run on, in the order the threads should be
+// pinned: round robin over the nodes (the first cpu of every node, then the
+// second...) so a few threads are spread over the sockets.
+std::vector<int> numa_cpus();
+
+// Pin the calling thread to the cpu, returns false if it can't be.
+bool numa_pin_thread(int cpu);
+
+// Interleave the pages of [ptr, ptr + size) over the nodes (the existing
+// pages are moved). Only the pages entirely within the range are changed,
+// it's meant for the large buffers. Returns false if it's not enabled, on a
+// single node, or the call failed.
+bool numa_interleave(void* ptr, size_t size);
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifdef __linux__
+  #include <sched.h>
+  #include <unistd.h>
+  #include <sys/syscall.h>
+#endif
+
+
+static std::atomic<bool> _numa_enabled(false);
+
+
+void set_numa_enabled(bool enabled) {
+  _numa_enabled.store(enabled);
+}
+
+
+bool numa_enabled() {
+  return _numa_enabled.load(std::memory_order_relaxed);
+}
+
+
+#ifdef __linux__
+
+// The mempolicy.h constants, to not depend on the numaif.h of libnuma.
+#define _NUMA_MPOL_INTERLEAVE 3
+#define _NUMA_MPOL_MF_MOVE    (1 << 1)
+
+// The nodes of the mask of mbind (the kernel supports more, they're not
+// expected on the machines we train on).
+#define _NUMA_MAX_NODES 64
+
+
+// Parse a sysfs list like "0-3,8-11", returns an empty list if the file
+// can't be read.
+static std::vector<int> _numa_read_list(const char* path) {
+  std::vector<int> list;
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) return list;
+
+  int begin, end;
+  char separator;
+  while (fscanf(file, "%d", &begin) == 1) {
+    end = begin;
+    if (fscanf(file, "%c", &separator) == 1 && separator == '-') {
+      if (fscanf(file, "%d", &end) != 1) break;
+      if (fscanf(file, "%c", &separator) != 1) separator = '\n';
+    }
+    for (int i = begin; i <= end; i++) list.push_back(i);
+    if (separator != ',') break;
+  }
+  fclose(file);
+  return list;
+}
+
+
+static std::vector<int> _numa_node_ids() {
+  std::vector<int> nodes = _numa_read_list("/sys/devices/system/node/online");
+  if (nodes.empty()) nodes.push_back(0);
+  return nodes;
+}
+
+
+int numa_nodes() {
+  static const int nodes = (int) _numa_node_ids().size();
+  return nodes;
+}
+
+
+std::vector<int> numa_cpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) return {};
+
+  // The allowed cpus of every node, or all of them if sysfs can't be read.
+  std::vector<std::vector<int>> per_node;
+  for (int node : _numa_node_ids()) {
+    char path[64];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    std::vector<int> cpus;
+    for (int cpu : _numa_read_list(path)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    if (!cpus.empty()) per_node.push_back(cpus);
+  }
+  if (per_node.empty()) {
+    per_node.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) per_node.back().push_back(cpu);
+    }
+  }
+
+  std::vector<int> cpus;
+  for (size_t i = 0;; i++) {
+    bool any = false;
+    for (const std::vector<int>& node : per_node) {
+      if (i < node.size()) {
+        cpus.push_back(node[i]);
+        any = true;
+      }
+    }
+    if (!any) break;
+  }
+  return cpus;
+}
+
+
+bool numa_pin_thread(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof set, &set) == 0; // 0 is the calling thread.
+}
+
+
+bool numa_interleave(void* ptr, size_t size) {
+  if (!numa_enabled() || numa_nodes() < 2 || ptr == nullptr) return false;
+
+  const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = ((uintptr_t) ptr + page - 1) & ~(page - 1);
+  const uintptr_t end = ((uintptr_t) ptr + size) & ~(page - 1);
+  if (end <= begin) return false;
+
+  unsigned long mask = 0;
+  for (int node : _numa_node_ids()) {
+    if (node < _NUMA_MAX_NODES) mask |= 1ul << node;
+  }
+  // The kernel takes the bits of the mask plus one.
+  return syscall(SYS_mbind, (void*) begin, (unsigned long) (end - begin), _NUMA_MPOL_INTERLEAVE,
+                 &mask, (unsigned long) _NUMA_MAX_NODES + 1, _NUMA_MPOL_MF_MOVE) == 0;
+}
+
+#else // !__linux__
+
+int numa_nodes() {
+  return 1;
+}
+
+
+std::vector<int> numa_cpus() {
+  return {};
+}
+
+
+bool numa_pin_thread(int) {
+  return false;
+}
+
+
+bool numa_interleave(void*, size_t) {
+  return false;
+}
+
+#endif // __linux__
+
+#endif // SINGLE_SOURCE_IMPL
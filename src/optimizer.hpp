@@ -0,0 +1,170 @@
+#pragma once
+
+#include "matrix.hpp"
+
+#include <memory>
+#include <vector>
+
+
+enum class OptimizerType {
+  SGD,
+  MOMENTUM,
+  NESTEROV,
+  RMSPROP,
+  ADAM,
+};
+
+
+struct OptimizerParams {
+  float momentum = 0.9f;  // Momentum and Nesterov.
+  float rho      = 0.9f;  // RMSProp decay of the squared gradient average.
+  float beta1    = 0.9f;  // Adam decay of the gradient average.
+  float beta2    = 0.999f; // Adam decay of the squared gradient average.
+  float epsilon  = 1e-8f; // RMSProp and Adam.
+};
+
+
+// Applies the gradients to the parameters. Each parameter (weights or
+// biases of a layer) is identified by an index and gets its own state
+// buffers (velocity, gradient averages...) of the same shape, which are
+// created on the first update.
+//
+// The updates are fused, a single pass reads the gradient and the state,
+// and writes both the state and the parameter.
+class Optimizer {
+public:
+  Optimizer(OptimizerType type, const OptimizerParams& params = OptimizerParams());
+
+  static const char* type_name(OptimizerType type);
+
+  // Call once per training step before the updates of the step.
+  void step();
+
+  // param -= learn_rate * (the optimizer's direction from grad).
+  void update(int param, MatrixView weights, ConstMatrixView grad, float learn_rate);
+
+  OptimizerType type;
+  OptimizerParams params;
+  int64_t steps = 0;
+
+  // state[param * slots() + slot], saved with the model.
+  std::vector<Matrix> state;
+
+  // Number of state buffers per parameter.
+  int slots() const;
+};
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+
+Optimizer::Optimizer(OptimizerType type, const OptimizerParams& params)
+  : type(type), params(params) {}
+
+
+const char* Optimizer::type_name(OptimizerType type) {
+  switch (type) {
+    case OptimizerType::SGD:      return "sgd";
+    case OptimizerType::MOMENTUM: return "momentum";
+    case OptimizerType::NESTEROV: return "nesterov";
+    case OptimizerType::RMSPROP:  return "rmsprop";
+    case OptimizerType::ADAM:     return "adam";
+  }
+  return "unknown";
+}
+
+
+int Optimizer::slots() const {
+  switch (type) {
+    case OptimizerType::SGD:      return 0;
+    case OptimizerType::MOMENTUM: return 1;
+    case OptimizerType::NESTEROV: return 1;
+    case OptimizerType::RMSPROP:  return 1;
+    case OptimizerType::ADAM:     return 2;
+  }
+  return 0;
+}
+
+
+void Optimizer::step() {
+  steps++;
+}
+
+
+void Optimizer::update(int param, MatrixView weights, ConstMatrixView grad, float learn_rate) {
+  assert(weights.rows() == grad.rows() && weights.cols() == grad.cols());
+  assert(weights.contiguous() && grad.contiguous());
+
+  const int n = weights.rows() * weights.cols();
+  matrix_t* w = weights.data();
+  const matrix_t* g = grad.data();
+
+  // Create the state buffers of the parameter.
+  const int slots = this->slots();
+  if ((int) state.size() < (param + 1) * slots) state.resize((param + 1) * slots);
+  matrix_t* s[2] = { nullptr, nullptr };
+  for (int i = 0; i < slots; i++) {
+    Matrix& buffer = state[param * slots + i];
+    if (buffer.rows() != weights.rows() || buffer.cols() != weights.cols()) {
+      buffer.init(weights.rows(), weights.cols());
+    }
+    s[i] = buffer.data().data();
+  }
+
+  const float lr = learn_rate;
+  const OptimizerParams& p = params;
+
+  switch (type) {
+    case OptimizerType::SGD:
+      for (int i = 0; i < n; i++) w[i] -= lr * g[i];
+      break;
+
+    // v = mu * v - lr * g; w += v
+    case OptimizerType::MOMENTUM: {
+      matrix_t* v = s[0];
+      for (int i = 0; i < n; i++) {
+        v[i] = p.momentum * v[i] - lr * g[i];
+        w[i] += v[i];
+      }
+    } break;
+
+    // Nesterov in the form of (Sutskever et al. 2013) which only needs the
+    // gradient at the current weights.
+    // v = mu * v - lr * g; w += -mu * v_prev + (1 + mu) * v
+    case OptimizerType::NESTEROV: {
+      matrix_t* v = s[0];
+      for (int i = 0; i < n; i++) {
+        matrix_t v_prev = v[i];
+        v[i] = p.momentum * v[i] - lr * g[i];
+        w[i] += -p.momentum * v_prev + (1 + p.momentum) * v[i];
+      }
+    } break;
+
+    // s = rho * s + (1 - rho) * g^2; w -= lr * g / (sqrt(s) + eps)
+    case OptimizerType::RMSPROP: {
+      matrix_t* sq = s[0];
+      for (int i = 0; i < n; i++) {
+        sq[i] = p.rho * sq[i] + (1 - p.rho) * g[i] * g[i];
+        w[i] -= lr * g[i] / (sqrtf(sq[i]) + p.epsilon);
+      }
+    } break;
+
+    // m = b1 * m + (1 - b1) * g; v = b2 * v + (1 - b2) * g^2
+    // w -= lr_t * m / (sqrt(v) + eps), lr_t has the bias corrections.
+    case OptimizerType::ADAM: {
+      assert(steps > 0 && "Optimizer::step() should be called before the updates.");
+      matrix_t* m = s[0];
+      matrix_t* v = s[1];
+      float correction1 = 1.f - powf(p.beta1, (float) steps);
+      float correction2 = 1.f - powf(p.beta2, (float) steps);
+      float lr_t = lr * sqrtf(correction2) / correction1;
+      for (int i = 0; i < n; i++) {
+        m[i] = p.beta1 * m[i] + (1 - p.beta1) * g[i];
+        v[i] = p.beta2 * v[i] + (1 - p.beta2) * g[i] * g[i];
+        w[i] -= lr_t * m[i] / (sqrtf(v[i]) + p.epsilon);
+      }
+    } break;
+  }
+}
+
+#endif // SINGLE_SOURCE_IMPL
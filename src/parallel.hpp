@@ -0,0 +1,334 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numa.hpp"
+#include "trace.hpp"
+
+
+// Number of threads the parallel kernels use (including the caller), it
+// defaults to the hardware concurrency. Setting it restarts the pool, it
+// shouldn't be called while a parallel_for() is running.
+int parallel_threads();
+void set_parallel_threads(int count);
+
+// Pin the worker threads of the pool to the cpus of numa_cpus(), spread over
+// the numa nodes (the calling thread isn't pinned, the first cpu is left to
+// it). It's off by default and restarts the pool, like set_parallel_threads().
+void set_parallel_affinity(bool pin);
+bool parallel_affinity();
+
+// True in a task of parallel_for(), where a nested parallel_for() runs in the
+// calling thread (the other threads are already busy with the outer one).
+bool parallel_in_task();
+
+
+// The worker threads of parallel_for(), started once and waiting for jobs.
+// The indices of a job are split into a range per thread (the caller is one
+// of them), a thread takes the indices from the front of its range and when
+// it's empty steals the back half of the range of another thread. A range is
+// a single atomic word so both are a compare exchange, without locks.
+//
+// A job runs at a time, a parallel_for() from a task or while another thread
+// runs a job is done serially by its caller, so the data parallel loops which
+// call the parallel kernels don't oversubscribe the cores.
+class ThreadPool {
+public:
+  static ThreadPool& get();
+
+  // The workers are pinned to the cpus of numa_cpus() if pin.
+  ThreadPool(int threads, bool pin);
+  ~ThreadPool();
+
+  // Threads running the jobs, including the caller.
+  int threads() const { return (int) _workers.size() + 1; }
+  bool pinned() const { return _pinned; }
+
+  // invoke(context, i) for every i in [0, count), returns once all are done.
+  void run(int count, void (*invoke)(void* context, int index), void* context);
+
+private:
+  struct alignas(64) Range {
+    std::atomic<uint64_t> value; // begin | end << 32.
+  };
+
+  void _worker(int slot, int cpu);
+  void _work(int slot);
+  bool _take(int slot, int* index);
+
+  std::vector<std::thread> _workers;
+  bool _pinned = false;
+  std::unique_ptr<Range[]> _ranges; // 0 is the caller, i + 1 the worker i.
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  uint64_t _generation = 0; // Incremented for every job.
+  bool _stop = false;
+
+  std::mutex _running; // Held by the caller of the job.
+  void (*_invoke)(void*, int) = nullptr;
+  void* _context = nullptr;
+  std::atomic<int> _remaining{0}; // Indices not finished.
+  std::atomic<int> _active{0};    // Workers in the job.
+};
+
+
+// Run fn(index) for every index in [0, count) across the threads, the calling
+// thread takes tasks as well and the call returns once all are done. The
+// tasks are picked dynamically so they don't have to be the same size.
+template <typename F>
+void parallel_for(int count, F fn) {
+  if (count <= 0) return;
+  if (count == 1 || parallel_threads() <= 1 || parallel_in_task()) {
+    for (int i = 0; i < count; i++) fn(i);
+    return;
+  }
+
+  auto invoke = [](void* context, int index) { (*(F*)context)(index); };
+  ThreadPool::get().run(count, invoke, &fn);
+}
+
+
+// fn(begin, end) over [0, size) in chunks of chunk_size, in parallel only if
+// the size is at least min_size. The chunks only split the loop, so the
+// results don't depend on the threads.
+template <typename F>
+void parallel_chunks(size_t size, size_t chunk_size, size_t min_size, F fn) {
+  if (size < min_size || size <= chunk_size) {
+    if (size > 0) fn((size_t) 0, size);
+    return;
+  }
+  const int chunks = (int)((size + chunk_size - 1) / chunk_size);
+  parallel_for(chunks, [&](int chunk) {
+    size_t begin = (size_t) chunk * chunk_size;
+    size_t end = (begin + chunk_size < size) ? begin + chunk_size : size;
+    fn(begin, end);
+  });
+}
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <stdio.h>
+
+static std::atomic<int> _parallel_threads(0);
+static std::atomic<bool> _parallel_affinity(false);
+static std::atomic<bool> _parallel_pin_failed(false); // Reported once, not at every restart.
+static thread_local bool _parallel_in_task = false;
+
+// The instance is read without the lock by ThreadPool::get(), the mutex is
+// only taken to create it or reset it.
+static std::mutex _pool_mutex;
+static std::unique_ptr<ThreadPool> _pool;
+static std::atomic<ThreadPool*> _pool_instance(nullptr);
+
+
+// Stop the workers of the pool, the next ThreadPool::get() starts new ones.
+// Called with _pool_mutex held.
+static void _pool_reset() {
+  _pool_instance.store(nullptr);
+  _pool.reset();
+}
+
+
+int parallel_threads() {
+  int count = _parallel_threads.load(std::memory_order_relaxed);
+  if (count > 0) return count;
+  count = (int) std::thread::hardware_concurrency();
+  return (count > 0) ? count : 1;
+}
+
+
+void set_parallel_threads(int count) {
+  _parallel_threads.store((count > 0) ? count : 0);
+
+  std::lock_guard<std::mutex> lock(_pool_mutex);
+  if (_pool != nullptr && _pool->threads() != parallel_threads()) _pool_reset();
+}
+
+
+void set_parallel_affinity(bool pin) {
+  _parallel_affinity.store(pin);
+
+  std::lock_guard<std::mutex> lock(_pool_mutex);
+  if (_pool != nullptr && _pool->pinned() != pin) _pool_reset();
+}
+
+
+bool parallel_affinity() {
+  return _parallel_affinity.load(std::memory_order_relaxed);
+}
+
+
+bool parallel_in_task() {
+  return _parallel_in_task;
+}
+
+
+ThreadPool& ThreadPool::get() {
+  ThreadPool* pool = _pool_instance.load(std::memory_order_acquire);
+  if (pool != nullptr) return *pool;
+
+  std::lock_guard<std::mutex> lock(_pool_mutex);
+  if (_pool == nullptr) {
+    _pool = std::make_unique<ThreadPool>(parallel_threads(), parallel_affinity());
+    _pool_instance.store(_pool.get(), std::memory_order_release);
+  }
+  return *_pool;
+}
+
+
+static inline uint64_t _range_pack(uint32_t begin, uint32_t end) {
+  return (uint64_t) begin | ((uint64_t) end << 32);
+}
+
+
+ThreadPool::ThreadPool(int threads, bool pin) {
+  if (threads < 1) threads = 1;
+  _ranges.reset(new Range[threads]);
+  for (int i = 0; i < threads; i++) _ranges[i].value.store(0);
+
+  // The worker of the slot takes the cpu of the same index, the cpus wrap
+  // around if there are more threads. The list is empty where pinning isn't
+  // supported, then the workers aren't pinned.
+  std::vector<int> cpus;
+  if (pin) cpus = numa_cpus();
+  _pinned = pin;
+
+  _workers.reserve(threads - 1);
+  for (int i = 0; i < threads - 1; i++) {
+    int cpu = (!cpus.empty()) ? cpus[(i + 1) % cpus.size()] : -1;
+    _workers.emplace_back([this, i, cpu]() { _worker(i + 1, cpu); });
+  }
+}
+
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for (std::thread& t : _workers) t.join();
+}
+
+
+void ThreadPool::run(int count, void (*invoke)(void*, int), void* context) {
+  if (count <= 0) return;
+
+  // Busy with the job of another thread.
+  if (_workers.empty() || !_running.try_lock()) {
+    for (int i = 0; i < count; i++) invoke(context, i);
+    return;
+  }
+
+  const int slots = threads();
+  for (int i = 0; i < slots; i++) {
+    uint32_t begin = (uint32_t)((int64_t) count * i / slots);
+    uint32_t end = (uint32_t)((int64_t) count * (i + 1) / slots);
+    _ranges[i].value.store(_range_pack(begin, end), std::memory_order_relaxed);
+  }
+  _remaining.store(count);
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _invoke = invoke;
+    _context = context;
+    _generation++;
+  }
+  _wake.notify_all();
+
+  _work(0);
+
+  // The tasks taken by the workers, then the workers which joined late have
+  // to leave before the next job resets the ranges.
+  while (_remaining.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _invoke = nullptr;
+    _context = nullptr;
+  }
+  while (_active.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+
+  _running.unlock();
+}
+
+
+void ThreadPool::_worker(int slot, int cpu) {
+  trace_thread_name("worker");
+  if (cpu >= 0 && !numa_pin_thread(cpu) && !_parallel_pin_failed.exchange(true)) {
+    fprintf(stderr, "parallel: cannot pin a worker to cpu %d\n", cpu);
+  }
+
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _wake.wait(lock, [&]() { return _stop || _generation != seen; });
+      if (_stop) return;
+      seen = _generation;
+      if (_invoke == nullptr) continue; // Finished before this thread woke.
+      _active++;
+    }
+    _work(slot);
+    _active.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+
+void ThreadPool::_work(int slot) {
+  TRACE_SCOPE("parallel_for", "parallel");
+  _parallel_in_task = true;
+
+  int index;
+  while (_take(slot, &index)) {
+    _invoke(_context, index);
+    _remaining.fetch_sub(1, std::memory_order_release);
+  }
+
+  _parallel_in_task = false;
+}
+
+
+bool ThreadPool::_take(int slot, int* index) {
+  // The front of the own range.
+  std::atomic<uint64_t>& own = _ranges[slot].value;
+  uint64_t value = own.load(std::memory_order_acquire);
+  for (;;) {
+    uint32_t begin = (uint32_t) value, end = (uint32_t)(value >> 32);
+    if (begin >= end) break;
+    if (own.compare_exchange_weak(value, _range_pack(begin + 1, end), std::memory_order_acq_rel)) {
+      *index = (int) begin;
+      return true;
+    }
+  }
+
+  // Steal the back half of the range of another thread, the first index is
+  // taken and the rest becomes the own range. A thief never changes an
+  // empty range, so the own range only changes here while it's empty.
+  const int slots = threads();
+  for (int i = 1; i < slots; i++) {
+    std::atomic<uint64_t>& victim = _ranges[(slot + i) % slots].value;
+    uint64_t value = victim.load(std::memory_order_acquire);
+    for (;;) {
+      uint32_t begin = (uint32_t) value, end = (uint32_t)(value >> 32);
+      if (begin >= end) break;
+      uint32_t split = end - (end - begin + 1) / 2;
+      if (victim.compare_exchange_weak(value, _range_pack(begin, split), std::memory_order_acq_rel)) {
+        own.store(_range_pack(split + 1, end), std::memory_order_release);
+        *index = (int) split;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+#endif // SINGLE_SOURCE_IMPL
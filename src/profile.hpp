@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+// The per layer counters of the training are only recorded when compiled
+// with NN_PROFILE defined (premake5 --profile), otherwise the PROFILE_ macros
+// are empty and the profile of the graph stays empty, so the hot path is the
+// same as without the instrumentation.
+#ifdef NN_PROFILE
+  #define PROFILE_ONLY(...) __VA_ARGS__
+#else
+  #define PROFILE_ONLY(...)
+#endif
+
+
+// The counters of a step of the graph (a node with its fused activation),
+// summed over the calls since the last reset.
+struct LayerProfile {
+  std::string name;           // Ex: "dense+relu".
+  int64_t forward_calls = 0;
+  int64_t backward_calls = 0;
+  double forward_ns = 0;
+  double backward_ns = 0;
+
+  // Estimates from the shapes: the forward flops of the node times the rows,
+  // twice that for the backward (the gradients of the parameters and of the
+  // inputs), and the bytes of the matrices read and written.
+  int64_t flops = 0;
+  int64_t bytes = 0;
+
+  int64_t allocations = 0;    // Of the memory pool in the calling thread.
+};
+
+
+// The profile of the training steps of a graph, reset by the caller (ex: at
+// the end of every epoch).
+struct GraphProfile {
+  std::vector<LayerProfile> layers; // A layer per step of the graph.
+  int64_t update_calls = 0;         // Optimizer updates of NN::backprop().
+  double update_ns = 0;
+
+  void reset();
+
+  double total_ns() const;
+
+  // A row per layer with its share of the time, and the totals.
+  void print() const;
+};
+
+
+// Nanoseconds since its construction.
+class ProfileTimer {
+public:
+  ProfileTimer() : _start(std::chrono::steady_clock::now()) {}
+
+  double ns() const {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - _start).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point _start;
+};
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <stdio.h>
+
+
+void GraphProfile::reset() {
+  for (LayerProfile& layer : layers) {
+    std::string name = std::move(layer.name);
+    layer = LayerProfile();
+    layer.name = std::move(name);
+  }
+  update_calls = 0;
+  update_ns = 0;
+}
+
+
+double GraphProfile::total_ns() const {
+  double total = update_ns;
+  for (const LayerProfile& layer : layers) total += layer.forward_ns + layer.backward_ns;
+  return total;
+}
+
+
+void GraphProfile::print() const {
+  const double total = total_ns();
+  auto percent = [&](double ns) { return (total > 0) ? ns / total * 100 : 0; };
+  auto per_call = [](double ns, int64_t calls) { return (calls > 0) ? ns / calls / 1000 : 0; };
+
+  printf("%-3s %-20s %12s %12s %7s %9s %9s %10s\n", "#", "layer", "fwd us/call", "bwd us/call",
+         "time", "GFLOP/s", "GB/s", "allocs");
+  for (size_t i = 0; i < layers.size(); i++) {
+    const LayerProfile& l = layers[i];
+    const double ns = l.forward_ns + l.backward_ns;
+    printf("%-3zu %-20s %12.2f %12.2f %6.1f%% %9.2f %9.2f %10lld\n", i, l.name.c_str(),
+           per_call(l.forward_ns, l.forward_calls), per_call(l.backward_ns, l.backward_calls),
+           percent(ns), (ns > 0) ? l.flops / ns : 0, (ns > 0) ? l.bytes / ns : 0,
+           (long long) l.allocations);
+  }
+  printf("%-3s %-20s %12.2f %12s %6.1f%%\n", "", "optimizer update",
+         per_call(update_ns, update_calls), "", percent(update_ns));
+  printf("total %.1f ms\n", total / 1e6);
+}
+
+#endif // SINGLE_SOURCE_IMPL
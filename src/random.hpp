@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// The blocks of consecutive counters are independent, Rng::blocks() runs the
+// rounds of several of them in the lanes of a register.
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define RANDOM_LANES 8
+#elif defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+  #define RANDOM_LANES 4
+#else
+  #define RANDOM_LANES 1
+#endif
+
+
+// The seed used by Rng::next() if random_seed() is never called, so the runs
+// are reproducible by default.
+#define RANDOM_DEFAULT_SEED 0x6e6e2d66726f6d73ull
+
+
+// A stream of random numbers from the Philox4x32-10 counter based generator.
+// Every block of 4 values is a pure function of (seed, stream, block index),
+// there is no state to advance, so any part of the stream can be generated
+// in any order from any number of threads and the values are the same.
+class Rng {
+public:
+  Rng(uint64_t seed = RANDOM_DEFAULT_SEED, uint64_t stream = 0);
+
+  // A new stream from the global seed, each call returns the next stream id
+  // (thread safe). This is what randomize() uses when no rng is given.
+  static Rng next();
+
+  // Write the 4 random values of the block into out.
+  void block(uint64_t index, uint32_t out[4]) const;
+
+  // The blocks [index, index + count) into out (4 * count values), the same
+  // values as block() computed RANDOM_LANES blocks at a time.
+  void blocks(uint64_t index, size_t count, uint32_t* out) const;
+
+  // Random value at the given index of the stream.
+  uint32_t at(uint64_t index) const;
+
+  uint64_t seed() const { return _seed; }
+  uint64_t stream() const { return _stream; }
+
+private:
+  uint64_t _seed;
+  uint64_t _stream;
+};
+
+
+// Set the global seed and reset the stream counter of Rng::next().
+void random_seed(uint64_t seed);
+
+
+// Uniform float in [0, 1) from the upper 24 bits.
+static inline float random_float(uint32_t bits) {
+  return (float)(bits >> 8) * (1.f / 16777216.f);
+}
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+static std::atomic<uint64_t> _random_seed(RANDOM_DEFAULT_SEED);
+static std::atomic<uint64_t> _random_stream(0);
+
+
+Rng::Rng(uint64_t seed, uint64_t stream)
+  : _seed(seed), _stream(stream) {}
+
+
+Rng Rng::next() {
+  return Rng(_random_seed.load(), _random_stream++);
+}
+
+
+void random_seed(uint64_t seed) {
+  _random_seed.store(seed);
+  _random_stream.store(0);
+}
+
+
+static inline void _mulhilo(uint32_t a, uint32_t b, uint32_t* hi, uint32_t* lo) {
+  uint64_t product = (uint64_t)a * (uint64_t)b;
+  *hi = (uint32_t)(product >> 32);
+  *lo = (uint32_t)product;
+}
+
+
+void Rng::block(uint64_t index, uint32_t out[4]) const {
+  // The counter is (block index, stream) and the key is the seed.
+  uint32_t c0 = (uint32_t)index, c1 = (uint32_t)(index >> 32);
+  uint32_t c2 = (uint32_t)_stream, c3 = (uint32_t)(_stream >> 32);
+  uint32_t k0 = (uint32_t)_seed, k1 = (uint32_t)(_seed >> 32);
+
+  for (int round = 0; round < 10; round++) {
+    uint32_t hi0, lo0, hi1, lo1;
+    _mulhilo(0xD2511F53, c0, &hi0, &lo0);
+    _mulhilo(0xCD9E8D57, c2, &hi1, &lo1);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+
+#if RANDOM_LANES > 1
+
+#if RANDOM_LANES == 8
+  typedef __m256i _random_vec;
+  #define _RANDOM_SET1(x)     _mm256_set1_epi32((int)(x))
+  #define _RANDOM_LOAD(p)     _mm256_loadu_si256((const __m256i*)(p))
+  #define _RANDOM_XOR(a, b)   _mm256_xor_si256(a, b)
+  #define _RANDOM_MUL(a, b)   _mm256_mul_epu32(a, b)
+  #define _RANDOM_SRL32(a)    _mm256_srli_epi64(a, 32)
+
+  // The 4 blocks of the 64 bit lanes of the words to out.
+  static inline void _random_store_blocks(uint32_t* out, __m256i w0, __m256i w1, __m256i w2, __m256i w3) {
+    __m256i w01 = _mm256_blend_epi32(w0, _mm256_slli_epi64(w1, 32), 0xAA);
+    __m256i w23 = _mm256_blend_epi32(w2, _mm256_slli_epi64(w3, 32), 0xAA);
+    __m256i even = _mm256_unpacklo_epi64(w01, w23); // Blocks 0 and 2.
+    __m256i odd = _mm256_unpackhi_epi64(w01, w23);  // Blocks 1 and 3.
+    _mm256_storeu_si256((__m256i*)out, _mm256_permute2x128_si256(even, odd, 0x20));
+    _mm256_storeu_si256((__m256i*)(out + 8), _mm256_permute2x128_si256(even, odd, 0x31));
+  }
+#else
+  typedef __m128i _random_vec;
+  #define _RANDOM_SET1(x)     _mm_set1_epi32((int)(x))
+  #define _RANDOM_LOAD(p)     _mm_loadu_si128((const __m128i*)(p))
+  #define _RANDOM_XOR(a, b)   _mm_xor_si128(a, b)
+  #define _RANDOM_MUL(a, b)   _mm_mul_epu32(a, b)
+  #define _RANDOM_SRL32(a)    _mm_srli_epi64(a, 32)
+
+  // The 2 blocks of the 64 bit lanes of the words to out.
+  static inline void _random_store_blocks(uint32_t* out, __m128i w0, __m128i w1, __m128i w2, __m128i w3) {
+    const __m128i low = _mm_set_epi32(0, -1, 0, -1);
+    __m128i w01 = _mm_or_si128(_mm_and_si128(w0, low), _mm_slli_epi64(w1, 32));
+    __m128i w23 = _mm_or_si128(_mm_and_si128(w2, low), _mm_slli_epi64(w3, 32));
+    _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi64(w01, w23));
+    _mm_storeu_si128((__m128i*)(out + 4), _mm_unpackhi_epi64(w01, w23));
+  }
+#endif
+
+
+// The RANDOM_LANES blocks from index. A word of a block is in the low half
+// of a 64 bit lane, so mul_epu32 gives the whole product of the round (its
+// low half is the lo of _mulhilo() and shifted down the hi). The high halves
+// of the lanes are ignored by the multiplies and dropped at the end. Each
+// register has RANDOM_LANES / 2 blocks, two are interleaved (a and b) to
+// hide the latency of the multiplies.
+static inline void _philox_lanes(uint64_t index, uint64_t stream, uint64_t seed, uint32_t* out) {
+  const int half = RANDOM_LANES / 2;
+  uint64_t counter0[RANDOM_LANES], counter1[RANDOM_LANES];
+  for (int i = 0; i < RANDOM_LANES; i++) {
+    counter0[i] = (uint32_t)(index + i);
+    counter1[i] = (index + i) >> 32;
+  }
+
+  _random_vec a0 = _RANDOM_LOAD(counter0), b0 = _RANDOM_LOAD(counter0 + half);
+  _random_vec a1 = _RANDOM_LOAD(counter1), b1 = _RANDOM_LOAD(counter1 + half);
+  _random_vec a2 = _RANDOM_SET1((uint32_t)stream), b2 = a2;
+  _random_vec a3 = _RANDOM_SET1((uint32_t)(stream >> 32)), b3 = a3;
+  const _random_vec m0 = _RANDOM_SET1(0xD2511F53), m1 = _RANDOM_SET1(0xCD9E8D57);
+  uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+
+  for (int round = 0; round < 10; round++) {
+    const _random_vec key0 = _RANDOM_SET1(k0), key1 = _RANDOM_SET1(k1);
+    _random_vec pa0 = _RANDOM_MUL(m0, a0), pa2 = _RANDOM_MUL(m1, a2);
+    _random_vec pb0 = _RANDOM_MUL(m0, b0), pb2 = _RANDOM_MUL(m1, b2);
+    a0 = _RANDOM_XOR(_RANDOM_XOR(_RANDOM_SRL32(pa2), a1), key0);
+    b0 = _RANDOM_XOR(_RANDOM_XOR(_RANDOM_SRL32(pb2), b1), key0);
+    a1 = pa2;
+    b1 = pb2;
+    a2 = _RANDOM_XOR(_RANDOM_XOR(_RANDOM_SRL32(pa0), a3), key1);
+    b2 = _RANDOM_XOR(_RANDOM_XOR(_RANDOM_SRL32(pb0), b3), key1);
+    a3 = pa0;
+    b3 = pb0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+
+  _random_store_blocks(out, a0, a1, a2, a3);
+  _random_store_blocks(out + 4 * half, b0, b1, b2, b3);
+}
+
+#endif // RANDOM_LANES > 1
+
+
+void Rng::blocks(uint64_t index, size_t count, uint32_t* out) const {
+  size_t i = 0;
+#if RANDOM_LANES > 1
+  for (; i + RANDOM_LANES <= count; i += RANDOM_LANES) {
+    _philox_lanes(index + i, _stream, _seed, out + 4 * i);
+  }
+#endif
+  for (; i < count; i++) block(index + i, out + 4 * i);
+}
+
+
+uint32_t Rng::at(uint64_t index) const {
+  uint32_t out[4];
+  block(index / 4, out);
+  return out[index % 4];
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+
+enum class LrScheduleType {
+  CONSTANT,
+  STEP,    // Multiply by gamma every step_epochs epochs.
+  COSINE,  // Cosine anneal from the base rate to min_rate over total_epochs.
+  PLATEAU, // Multiply by gamma when the validation error stops improving.
+};
+
+
+struct LrScheduleParams {
+  float base_rate      = 0.01f;
+  float min_rate       = 0.f;   // Cosine and plateau never go below this.
+  int64_t warmup_steps = 0;     // Linear ramp from 0 to the rate, any type.
+  float gamma          = 0.1f;  // Step and plateau factor.
+  int step_epochs      = 1;     // Step.
+  int total_epochs     = 10;    // Cosine.
+  int patience         = 2;     // Plateau, epochs without improvement.
+  float threshold      = 1e-4f; // Plateau, relative improvement that counts.
+};
+
+
+// The learning rate of each training step. The rate is a function of the
+// global step (for the warmup) and the epoch, and for the plateau schedule of
+// the validation errors reported at the end of each epoch.
+class LrSchedule {
+public:
+  LrSchedule(LrScheduleType type = LrScheduleType::CONSTANT,
+             const LrScheduleParams& params = LrScheduleParams());
+
+  static const char* type_name(LrScheduleType type);
+
+  // The learning rate for the step (number of steps trained so far) of the
+  // epoch (number of finished epochs).
+  float rate(int64_t step, int epoch) const;
+
+  // Report the validation error at the end of an epoch.
+  void epoch_end(float validation_error);
+
+  LrScheduleType type;
+  LrScheduleParams params;
+
+private:
+  float _scale = 1.f; // Plateau, product of the reductions so far.
+  float _best = INFINITY;
+  int _bad_epochs = 0;
+};
+
+
+// Stops the training when the validation error didn't improve by at least
+// min_delta for patience epochs.
+class EarlyStopping {
+public:
+  EarlyStopping(int patience = 3, float min_delta = 1e-4f, int max_epochs = 50);
+
+  // Report the validation error at the end of an epoch, returns true if it's
+  // the best so far.
+  bool epoch_end(float validation_error);
+
+  bool should_stop() const;
+
+  float best() const { return _best; }
+  int best_epoch() const { return _best_epoch; }
+  int epochs() const { return _epochs; }
+
+  int patience;
+  float min_delta;
+  int max_epochs; // Stop after this many epochs regardless.
+
+private:
+  float _best = INFINITY;
+  int _best_epoch = -1;
+  int _epochs = 0;
+};
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+
+LrSchedule::LrSchedule(LrScheduleType type, const LrScheduleParams& params)
+  : type(type), params(params) {}
+
+
+const char* LrSchedule::type_name(LrScheduleType type) {
+  switch (type) {
+    case LrScheduleType::CONSTANT: return "constant";
+    case LrScheduleType::STEP:     return "step";
+    case LrScheduleType::COSINE:   return "cosine";
+    case LrScheduleType::PLATEAU:  return "plateau";
+  }
+  return "unknown";
+}
+
+
+float LrSchedule::rate(int64_t step, int epoch) const {
+  const LrScheduleParams& p = params;
+  float rate = p.base_rate;
+
+  switch (type) {
+    case LrScheduleType::CONSTANT:
+      break;
+
+    case LrScheduleType::STEP:
+      assert(p.step_epochs > 0);
+      rate *= powf(p.gamma, (float)(epoch / p.step_epochs));
+      break;
+
+    case LrScheduleType::COSINE: {
+      assert(p.total_epochs > 0);
+      float t = (epoch < p.total_epochs) ? (float) epoch / p.total_epochs : 1.f;
+      rate = p.min_rate + (p.base_rate - p.min_rate) * .5f * (1.f + cosf(3.14159265f * t));
+    } break;
+
+    case LrScheduleType::PLATEAU:
+      rate *= _scale;
+      if (rate < p.min_rate) rate = p.min_rate;
+      break;
+  }
+
+  if (step < p.warmup_steps) {
+    rate *= (float)(step + 1) / (float) p.warmup_steps;
+  }
+  return rate;
+}
+
+
+void LrSchedule::epoch_end(float validation_error) {
+  if (type != LrScheduleType::PLATEAU) return;
+
+  if (validation_error < _best * (1.f - params.threshold)) {
+    _best = validation_error;
+    _bad_epochs = 0;
+    return;
+  }
+
+  if (++_bad_epochs > params.patience) {
+    _scale *= params.gamma;
+    _bad_epochs = 0;
+  }
+}
+
+
+EarlyStopping::EarlyStopping(int patience, float min_delta, int max_epochs)
+  : patience(patience), min_delta(min_delta), max_epochs(max_epochs) {}
+
+
+bool EarlyStopping::epoch_end(float validation_error) {
+  _epochs++;
+  if (validation_error < _best - min_delta) {
+    _best = validation_error;
+    _best_epoch = _epochs;
+    return true;
+  }
+  return false;
+}
+
+
+bool EarlyStopping::should_stop() const {
+  if (_epochs >= max_epochs) return true;
+  return _best_epoch >= 0 && _epochs - _best_epoch >= patience;
+}
+
+#endif // SINGLE_SOURCE_IMPL
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+// Versions of a value published by a writer thread to any number of reader
+// threads (RCU like). A version is immutable once published, a reader takes
+// a reference to the latest one and keeps it as long as it needs (drawing a
+// frame, writing a checkpoint...) while the writer goes on publishing newer
+// ones. The writer never waits for the readers and the readers never see a
+// version while it's written.
+//
+//   // Writer (a single thread).
+//   publisher.publish([&](Weights& w) { w = weights; });
+//
+//   // Any reader thread.
+//   std::shared_ptr<const Snapshot<Weights>> s = publisher.get();
+//   if (s) draw(s->value, s->version);
+//
+// The retired version is reused for the next publish() once no reader holds
+// it, so publishing at the same rate as the readers doesn't allocate (the
+// matrices of the value keep their capacity).
+
+
+template <typename T>
+struct Snapshot {
+  uint64_t version = 0; // 1 for the first publish().
+  T value;
+};
+
+
+template <typename T>
+class SnapshotPublisher {
+public:
+  // The latest version, null before the first publish(). Thread safe.
+  std::shared_ptr<const Snapshot<T>> get() const {
+    return std::atomic_load(&_current);
+  }
+
+  // Fill the next version with fill(T&) and publish it, returns its version.
+  // The value given to fill() is either new or a retired version, it should
+  // be overwritten entirely. Only a thread at a time can publish.
+  template <typename F>
+  uint64_t publish(F fill) {
+    std::shared_ptr<Snapshot<T>> next = std::move(_spare);
+
+    // The retired version isn't reachable from _current anymore, so if it's
+    // only referenced here no reader can take it again. The fence orders the
+    // reads of its last reader before the writes below.
+    if (next != nullptr && next.use_count() == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } else {
+      next = std::make_shared<Snapshot<T>>();
+    }
+
+    fill(next->value);
+    next->version = ++_version;
+
+    std::shared_ptr<const Snapshot<T>> published = next;
+    std::shared_ptr<const Snapshot<T>> retired = std::atomic_exchange(&_current, std::move(published));
+    _spare = std::const_pointer_cast<Snapshot<T>>(std::move(retired));
+    return _version;
+  }
+
+  // The last published version, for the writer thread.
+  uint64_t version() const { return _version; }
+
+private:
+  std::shared_ptr<const Snapshot<T>> _current;
+  std::shared_ptr<Snapshot<T>> _spare; // The previous version, only used by publish().
+  uint64_t _version = 0;
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// A timeline of the spans of the training (data loading, forward, backward,
+// update, ui frames...) per thread, written in the chrome trace event format
+// (open it in chrome://tracing or ui.perfetto.dev). The spans are recorded
+// only between trace_start() and trace_stop(), otherwise a TraceScope is a
+// single relaxed load.
+//
+//   trace_start();
+//   { TRACE_SCOPE("forward"); nn.forward(input); }
+//   trace_stop();
+//   trace_write("trace.json");
+
+// Spans recorded per thread, the rest are dropped (and counted) so a long
+// session doesn't grow without a limit.
+#define TRACE_MAX_EVENTS (1 << 20)
+
+
+// Clears the previous spans and starts recording.
+void trace_start();
+void trace_stop();
+bool trace_enabled();
+
+// Write the recorded spans as json, usually after trace_stop(). The spans of
+// the threads still running which end later aren't written. Returns false if
+// the file can't be written.
+bool trace_write(const char* path);
+
+// Name the row of the calling thread in the trace, the names should be
+// literals (they're not copied). Threads without a name are "thread <id>".
+void trace_thread_name(const char* name);
+
+
+// Records a span from its construction to its destruction in the calling
+// thread, the name and category should be literals.
+class TraceScope {
+public:
+  TraceScope(const char* name, const char* category = "nn");
+  ~TraceScope();
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+  const char* _name;
+  const char* _category;
+  int64_t _start = -1; // Nanoseconds, -1 if not recording.
+};
+
+#define _TRACE_CONCAT(a, b) a##b
+#define _TRACE_NAME(line) _TRACE_CONCAT(_trace_scope_, line)
+#define TRACE_SCOPE(...) TraceScope _TRACE_NAME(__LINE__)(__VA_ARGS__)
+
+
+#ifdef SINGLE_SOURCE_IMPL
+
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+struct _TraceEvent {
+  const char* name;
+  const char* category;
+  int64_t start; // Nanoseconds since trace_start().
+  int64_t duration;
+};
+
+
+// The events of a thread. A slot is taken by a thread at its first event and
+// released when the thread exits, the next new thread reuses it, so the
+// threads of a restarted pool (set_parallel_threads()) share the rows of the
+// trace instead of adding new ones. The mutex of the slot guards its name and
+// events, it's only contended by trace_start() and trace_write().
+struct _TraceSlot {
+  int id = 0;
+  bool in_use = false; // Guarded by _trace_mutex.
+  std::mutex mutex;
+  const char* name = nullptr;
+  std::vector<_TraceEvent> events;
+  int64_t dropped = 0;
+};
+
+
+static std::atomic<bool> _trace_enabled(false);
+static std::atomic<int64_t> _trace_epoch(0); // steady_clock nanoseconds of trace_start().
+static std::mutex _trace_mutex;
+static std::vector<std::unique_ptr<_TraceSlot>> _trace_slots;
+
+
+static int64_t _trace_clock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Owns the slot of a thread for its lifetime.
+struct _TraceThread {
+  _TraceSlot* slot = nullptr;
+
+  _TraceSlot* get() {
+    if (slot != nullptr) return slot;
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    for (std::unique_ptr<_TraceSlot>& s : _trace_slots) {
+      if (!s->in_use) {
+        slot = s.get();
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      _trace_slots.push_back(std::make_unique<_TraceSlot>());
+      slot = _trace_slots.back().get();
+      slot->id = (int) _trace_slots.size() - 1;
+    } else {
+      // The row of the previous thread isn't continued by this one.
+      std::lock_guard<std::mutex> slot_lock(slot->mutex);
+      slot->name = nullptr;
+      slot->events.clear();
+      slot->dropped = 0;
+    }
+    slot->in_use = true;
+    return slot;
+  }
+
+  ~_TraceThread() {
+    if (slot == nullptr) return;
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    slot->in_use = false;
+  }
+};
+
+
+static thread_local _TraceThread _trace_thread;
+
+
+void trace_start() {
+  {
+    std::lock_guard<std::mutex> lock(_trace_mutex);
+    for (std::unique_ptr<_TraceSlot>& slot : _trace_slots) {
+      std::lock_guard<std::mutex> slot_lock(slot->mutex);
+      slot->events.clear();
+      slot->dropped = 0;
+    }
+  }
+  _trace_epoch.store(_trace_clock());
+  _trace_enabled.store(true);
+}
+
+
+void trace_stop() {
+  _trace_enabled.store(false);
+}
+
+
+bool trace_enabled() {
+  return _trace_enabled.load(std::memory_order_relaxed);
+}
+
+
+void trace_thread_name(const char* name) {
+  _TraceSlot* slot = _trace_thread.get();
+  std::lock_guard<std::mutex> lock(slot->mutex);
+  slot->name = name;
+}
+
+
+TraceScope::TraceScope(const char* name, const char* category)
+  : _name(name), _category(category) {
+  if (trace_enabled()) _start = _trace_clock();
+}
+
+
+TraceScope::~TraceScope() {
+  if (_start < 0) return;
+  int64_t end = _trace_clock();
+
+  _TraceSlot* slot = _trace_thread.get();
+  std::lock_guard<std::mutex> lock(slot->mutex);
+  if (slot->events.size() >= TRACE_MAX_EVENTS) {
+    slot->dropped++;
+    return;
+  }
+  const int64_t epoch = _trace_epoch.load(std::memory_order_relaxed);
+  slot->events.push_back({ _name, _category, _start - epoch, end - _start });
+}
+
+
+bool trace_write(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) return false;
+
+  std::lock_guard<std::mutex> lock(_trace_mutex);
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+  bool first = true;
+  for (const std::unique_ptr<_TraceSlot>& slot : _trace_slots) {
+    std::lock_guard<std::mutex> slot_lock(slot->mutex);
+
+    // The names are literals of the code, they're written without escaping.
+    fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"", (first) ? "" : ",\n", slot->id);
+    if (slot->name != nullptr) fprintf(file, "%s\"}}", slot->name);
+    else fprintf(file, "thread %d\"}}", slot->id);
+    first = false;
+
+    for (const _TraceEvent& e : slot->events) {
+      fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f}", e.name, e.category, slot->id, e.start / 1e3, e.duration / 1e3);
+    }
+    if (slot->dropped > 0) {
+      fprintf(stderr, "trace: %lld spans of thread %d dropped (more than %d)\n",
+              (long long) slot->dropped, slot->id, TRACE_MAX_EVENTS);
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return true;
+}
+
+#endif // SINGLE_SOURCE_IMPL
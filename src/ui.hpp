@@ -58,10 +58,19 @@ private:
 
   void _check_box(Rectangle area, const char* label, bool* active);
 
+  // The values drawn are of the snapshot of the model taken by update() (see
+  // NN::publish()), or of the model itself if there's none yet.
+  bool _has_snapshot() const;
+  void _publish();
+  const Matrix& _layer_outputs(int layer) const;
+  matrix_t _weight(int layer, const DenseNode* dense, int row, int col) const;
+  matrix_t _bias(int layer, const DenseNode* dense, int col) const;
+
   State state = State::IDLE;
   bool training = true; // Either we're training or testing.
 
   NN* nn = nullptr;
+  std::shared_ptr<const Snapshot<NNSnapshot>> snapshot;
   DsMinist* dset_train = nullptr;
   DsMinist* dset_test = nullptr;
 
@@ -174,6 +183,7 @@ void UI::_forward_canvas() {
   UnloadImage(img);
 
   nn->forward(input);
+  _publish();
 }
 
 
@@ -210,6 +220,46 @@ void UI::handle_inputs() {
 }
 
 
+bool UI::_has_snapshot() const {
+  // A snapshot of an other model (before a load) isn't used.
+  return snapshot != nullptr &&
+    snapshot->value.layer_outputs.size() == (size_t) nn->graph.layer_count() &&
+    snapshot->value.parameters.size() == nn->graph.parameters().size();
+}
+
+
+// The ui runs in the training thread, so it publishes the changes it makes
+// to the model itself to draw them in the same frame.
+void UI::_publish() {
+  nn->publish();
+  snapshot = nn->snapshot();
+}
+
+
+const Matrix& UI::_layer_outputs(int layer) const {
+  if (_has_snapshot()) return snapshot->value.layer_outputs[layer];
+  return nn->graph.layer_outputs(layer);
+}
+
+
+matrix_t UI::_weight(int layer, const DenseNode* dense, int row, int col) const {
+  int index = nn->graph.layer_parameter(layer);
+  if (_has_snapshot() && index >= 0) {
+    const Matrix& weights = snapshot->value.parameters[index];
+    // Empty if only the packed weights are kept.
+    if (!weights.data().empty()) return weights.at(row, col);
+  }
+  return dense->weight(row, col);
+}
+
+
+matrix_t UI::_bias(int layer, const DenseNode* dense, int col) const {
+  int index = nn->graph.layer_parameter(layer);
+  if (_has_snapshot() && index >= 0) return snapshot->value.parameters[index + 1].at(0, col);
+  return dense->bias.at(0, col);
+}
+
+
 Color UI::_interpolated_color(Color from, Color to, float weight) {
   weight = 1.f / (1.f + expf(-weight));
   Color r;
@@ -288,6 +338,7 @@ void UI::_update_area() {
 
 
 void UI::update() {
+  snapshot = nn->snapshot();
   _update_area();
   if (!msg.empty() && GetTime() - msg_time > msg_max_time) {
     msg = "";
@@ -450,6 +501,7 @@ void UI::draw_inputs() {
     comp_area.y += comp_area.height + padding;
     if (GuiButton(comp_area, "load model") && state != DRAWING) {
       nn->load("nn");
+      _publish();
       message("Model loaded from \"./nn\"!");
     }
   }
@@ -466,9 +518,15 @@ void UI::draw_inputs() {
 void UI::draw_neuron_info() {
   if (selected_neuron.x < 0 || selected_neuron.y < 0) return;
 
-  const Layer& layer = nn->layers[(int)selected_neuron.x];
-  matrix_t activation = layer.outputs.at(0, (int)selected_neuron.y);
-  matrix_t biased = layer.biased.at(0, (int)selected_neuron.y);
+  const int layer_index = (int)selected_neuron.x;
+  const Matrix& outputs = _layer_outputs(layer_index);
+  matrix_t activation = outputs.at(0, (int)selected_neuron.y);
+
+  // The weights of a conv layer are shared, they're not per neuron.
+  const Node* node = nn->graph.layer_node(layer_index);
+  const DenseNode* dense = (node && node->type() == NodeType::DENSE)
+    ? static_cast<const DenseNode*>(node) : nullptr;
+  matrix_t biased = (dense) ? _bias(layer_index, dense, (int)selected_neuron.y) : 0;
 
   Rectangle area = area_neuron_info;
   DrawRectangleRec(area, color_pannel);
@@ -487,11 +545,13 @@ void UI::draw_neuron_info() {
   pos.y += font_size + padding;
   DrawText((std::string("Biased: ") + std::to_string(biased)).c_str(), pos.x, pos.y, font_size, BLACK);
 
-  if (selected_neuron.x > 0) {
-    const Layer& prev = nn->layers[(int)(selected_neuron.x - 1)];
-    for (int i = 0; i < prev.weights.rows(); i++) {
-      matrix_t a = prev.outputs.at(0, i);
-      matrix_t w = prev.weights.at(i, (int)selected_neuron.y);
+  if (dense) {
+    const Matrix& inputs = _layer_outputs(layer_index - 1);
+
+    // The incoming weights of the neuron is a column of the weights.
+    for (int i = 0; i < inputs.cols(); i++) {
+      matrix_t a = inputs.at(0, i);
+      matrix_t w = _weight(layer_index, dense, i, (int)selected_neuron.y);
 
       pos.y += font_size + padding;
       char buff[2048];
@@ -688,20 +748,21 @@ void UI::draw_nn_graph() {
   Vector2 mouse_pos_graph = GetScreenToWorld2D(GetMousePosition(), cam_nn);
 
   int max_activation_count = 0;
-  for (const Layer& layer : nn->layers) {
-    max_activation_count = std::max(max_activation_count, layer.outputs.cols());
+  const int layer_count = nn->graph.layer_count();
+  for (int i = 0; i < layer_count; i++) {
+    max_activation_count = std::max(max_activation_count, _layer_outputs(i).cols());
   }
 
   // This will be the length between first neuron and last neuron of the longest layer.
   float max_layer_height = (max_activation_count - 1) * (neuron_gap + 2 * neuron_radius);
 
   // We'll draw from here to make sure the NN is in the middle of the view.
-  float offset_x = (area_nn.width - ((nn->layers.size() - 1) * layer_gap)) / 2.f;
+  float offset_x = (area_nn.width - ((layer_count - 1) * layer_gap)) / 2.f;
   float offset_y = (area_nn.height - max_layer_height) / 2.f;
 
   // Returns the position of a neuron.
   auto get_pos = [=](int layer_index, int neuron_index) {
-    int cols = nn->layers[layer_index].outputs.cols();
+    int cols = _layer_outputs(layer_index).cols();
     float curr_layer_height = (cols - 1) * (neuron_gap + 2 * neuron_radius);
     float x = offset_x + layer_gap * layer_index;
     float y = offset_y + (max_layer_height - curr_layer_height) / 2.f;
@@ -717,19 +778,22 @@ void UI::draw_nn_graph() {
   {
 
     // Draw connections.
-    for (int layer_index = (int)(nn->layers.size()) - 1; layer_index >= 0; layer_index--) {
-      const Layer& layer = nn->layers[layer_index];
+    for (int layer_index = layer_count - 1; layer_index >= 0; layer_index--) {
+      const Matrix& outputs = _layer_outputs(layer_index);
+      const Node* node = nn->graph.layer_node(layer_index);
+      const DenseNode* dense = (node && node->type() == NodeType::DENSE)
+        ? static_cast<const DenseNode*>(node) : nullptr;
 
-      for (int neuron_index = 0; neuron_index < layer.outputs.cols(); neuron_index++) {
+      for (int neuron_index = 0; neuron_index < outputs.cols(); neuron_index++) {
         Vector2 pos = get_pos(layer_index, neuron_index);
         Vector2 screen_pos = GetWorldToScreen2D({ pos.x, pos.y }, cam_nn);
         if (CheckCollisionPointRec(screen_pos, area_nn)) {
-          if (layer_index > 0) {
-            int prev_cols = nn->layers[layer_index - 1].outputs.cols();
+          if (dense) {
+            int prev_cols = _layer_outputs(layer_index - 1).cols();
             for (int j = 0; j < prev_cols; j++) {
               Vector2 pos_prev = get_pos(layer_index - 1, j);
 
-              matrix_t w = nn->layers[layer_index - 1].weights.at(j, neuron_index);
+              matrix_t w = _weight(layer_index, dense, j, neuron_index);
               Color color = _interpolated_color(color_conn_min, color_conn_max, w);
               DrawLineEx(pos_prev, pos, 1, color);
             }
@@ -740,21 +804,21 @@ void UI::draw_nn_graph() {
     }
 
     // Draw the neuron.
-    for (int layer_index = (int)(nn->layers.size()) - 1; layer_index >= 0; layer_index--) {
-      const Layer& layer = nn->layers[layer_index];
+    for (int layer_index = layer_count - 1; layer_index >= 0; layer_index--) {
+      const Matrix& outputs = _layer_outputs(layer_index);
 
       // Get the maximum confident neuron.
       int confident_neuron_index = -1;
       matrix_t max_conf = 0.f;
-      for (int i = 0; i < layer.outputs.cols(); i++) {
-        matrix_t curr = layer.outputs.at(0, i);
+      for (int i = 0; i < outputs.cols(); i++) {
+        matrix_t curr = outputs.at(0, i);
         if (curr >= max_conf) {
           confident_neuron_index = i;
           max_conf = curr;
         }
       }
 
-      for (int neuron_index = 0; neuron_index < layer.outputs.cols(); neuron_index++) {
+      for (int neuron_index = 0; neuron_index < outputs.cols(); neuron_index++) {
         Vector2 pos = get_pos(layer_index, neuron_index);
         Vector2 screen_pos = GetWorldToScreen2D({ pos.x, pos.y }, cam_nn);
 
@@ -774,7 +838,7 @@ void UI::draw_nn_graph() {
 
           }
 
-          matrix_t activation = layer.outputs.at(0, neuron_index);
+          matrix_t activation = outputs.at(0, neuron_index);
           Color color = _interpolated_color(color_neuron_min, color_neuron_max, activation);
           if (selected_neuron.x == layer_index && selected_neuron.y == neuron_index) {
             color = color_selected_neuron;
@@ -791,7 +855,7 @@ void UI::draw_nn_graph() {
             20,
             BLACK);
 
-          if (layer_index == nn->layers.size() - 1) {
+          if (layer_index == layer_count - 1) {
             DrawText(
               nn->output_labels[neuron_index].c_str(),
               pos.x + neuron_radius + padding,
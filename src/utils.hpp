@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "matrix.hpp"
+#include "numa.hpp"
 #include "nn.hpp"
 
 typedef Image GrayImage;
@@ -19,9 +20,15 @@ public:
   std::vector<uint8_t> labels;
   std::vector<GrayImage> images;
 
+  // All the images normalized, one per row, which are used for training.
+  Matrix inputs;
+
   int count() const override;
   Matrix get_input(int index) const override;
   Matrix get_output(int index) const override;
+  ConstMatrixView input_view(int index) const override;
+  ConstMatrixView input_batch(int index, int count) const override;
+  int get_label(int index) const override;
 
   static Matrix image_to_input(GrayImage* image);
 
@@ -114,12 +121,21 @@ DsMinist::DsMinist(const char* path_labels, const char* path_images) {
     READ_INT(rows, ptr);
     READ_INT(cols, ptr);
 
+    inputs.init(size, rows * cols);
     for (uint32_t i = 0; i < size; i++) {
       Image img = gen_image_gray(cols, rows, ptr);
       images.push_back(img);
+
+      matrix_t* row = inputs.row(i).data();
+      for (uint32_t j = 0; j < rows * cols; j++) {
+        row[j] = (matrix_t)ptr[j] / 255.f;
+      }
       ptr += (cols * rows);
     }
 
+    // Read by all the threads of the evaluation.
+    numa_interleave(inputs.data().data(), inputs.data().size() * sizeof(matrix_t));
+
     UnloadFileData(data);
   }
 
@@ -127,8 +143,22 @@ DsMinist::DsMinist(const char* path_labels, const char* path_images) {
 }
 
 Matrix DsMinist::get_input(int index) const {
-  const GrayImage& image = images[index];
-  return _image_to_input(&image);
+  return inputs.row(index);
+}
+
+
+ConstMatrixView DsMinist::input_view(int index) const {
+  return inputs.row(index);
+}
+
+
+ConstMatrixView DsMinist::input_batch(int index, int count) const {
+  return ConstMatrixView(inputs).rows(index, count);
+}
+
+
+int DsMinist::get_label(int index) const {
+  return labels[index];
 }
 
 Matrix DsMinist::get_output(int index) const {
@@ -147,10 +177,10 @@ Matrix DsMinist::image_to_input(GrayImage* image) {
 
 Matrix DsMinist::_image_to_input(const GrayImage* image) {
   assert(image != nullptr);
-  assert(image->width == 28 && image->height == 28, "Resize image to 28 * 28 before calling this function.");
+  assert(image->width == 28 && image->height == 28 && "Resize image to 28 * 28 before calling this function.");
 
   Matrix m(1, image->height * image->width);
-  std::vector<matrix_t>& data = m.data();
+  Matrix::data_t& data = m.data();
   for (size_t i = 0; i < data.size(); i++) {
     data[i] = (matrix_t)(*((data_t*)(image->data) + i)) / 255.f;
   }